@@ -272,11 +272,11 @@ void nbcg::generateXS(const gp::FileDescriptor* file) const {
             auto m = s->method(j);
             xs_ << "        case ProcNumber::" << m->name() << ":\n"
                 << "            if (NB_" << up(m->name()) << ") {\n"
-                << "                rpc::grequest_remote<ProcNumber::" << m->name() << ", true, asrt_type> q(h->seq_, c);\n"
+                << "                rpc::grequest_remote<ProcNumber::" << m->name() << ", true, asrt_type> q(h->seq_, c, p.deadline_);\n"
                 << "                p.parse_message(q.req_);\n"
                 << "                " << m->name() << "(q, now);\n"
                 << "            } else {\n"
-                << "                auto q = new rpc::grequest_remote<ProcNumber::" << m->name() << ", false, asrt_type>(h->seq_, c);\n"
+                << "                auto q = new rpc::grequest_remote<ProcNumber::" << m->name() << ", false, asrt_type>(h->seq_, c, p.deadline_);\n"
                 << "                p.parse_message(q->req_);\n"
                 << "                " << m->name() << "(q, now);\n"
                 << "            }break;\n";
@@ -286,6 +286,24 @@ void nbcg::generateXS(const gp::FileDescriptor* file) const {
             << "        }\n"
             << "    }\n";
 
+        // dispatch_local
+        xs_ << "    virtual bool dispatch_local(rpc::grequest_base* q, uint64_t now) {\n"
+            << "       switch (q->proc()) {\n";
+        for (int j = 0; j < s->method_count(); ++j) {
+            auto m = s->method(j);
+            xs_ << "        case ProcNumber::" << m->name() << ":\n"
+                << "            if (NB_" << up(m->name()) << ") {\n"
+                << "                rpc::grequest_nb_toggled<ProcNumber::" << m->name() << "> nq(static_cast<rpc::grequest<ProcNumber::" << m->name() << ", false>*>(q));\n"
+                << "                " << m->name() << "(nq, now);\n"
+                << "            } else\n"
+                << "                " << m->name() << "(static_cast<rpc::grequest<ProcNumber::" << m->name() << ", false>*>(q), now);\n"
+                << "            return true;\n";
+        };
+        xs_ << "        default:\n"
+            << "            return false;\n"
+            << "        }\n"
+            << "    }\n";
+
         // dispatch_sync
         xs_ << "    typedef typename rpc::rpc_server_base<T>::srt_type srt_type;\n";
 
@@ -7,6 +7,8 @@
 #include "rpc_common/compiler.hh"
 #include "gcrequest.hh"
 #include "tcp_provider.hh"
+#include "inproc.hh"
+#include <unordered_set>
 
 namespace rpc {
 
@@ -18,10 +20,24 @@ struct rpc_handler {
     virtual void handle_rpc(async_rpcc<T> *c, parser& p) = 0;
     virtual void handle_client_failure(async_rpcc<T> *c) = 0;
     virtual void handle_post_failure(async_rpcc<T> *c) = 0;
+    virtual void handle_throttle(async_rpcc<T> *c, bool throttled) {}
+    // The connection made by async_rpcc::connect is established. Not
+    // called for one the constructor makes (force_connected), since the
+    // handler may be the object under construction.
+    virtual void handle_connected(async_rpcc<T> *c) {}
+    // Called on failure for each outstanding call, between
+    // handle_client_failure and handle_post_failure. Return true to
+    // keep @a q (e.g. to resend it), false to complete it with an error.
+    virtual bool handle_lost_call(async_rpcc<T> *c, gcrequest_base *q) {
+	return false;
+    }
+    // @a c leaves for another loop (see async_rpcc::migrate) and will not
+    // call this handler again
+    virtual void handle_detached(async_rpcc<T> *c) {}
 };
 
 template <typename T>
-class async_rpcc : public transport_handler<T> {
+class async_rpcc : public transport_handler<T>, public call_owner {
   public:
     async_rpcc(tcp_provider* tcpp,
 	       rpc_handler<T>* rh, bool force_connected,
@@ -29,104 +45,348 @@ class async_rpcc : public transport_handler<T> {
 
     virtual ~async_rpcc();
     inline bool connect() {
-	mandatory_assert(c_ == NULL);
-	int fd = tcpp_->connect();
-        if (fd < 0) {
-	    fprintf(stderr, "async_rpcc: failed to connect\n");
-            return false;
-	}
-	typedef typename T::async_transport transport;
-	transport* tp = T::template make<transport>(fd);
-	if (tp)
-            c_ = new async_buffered_transport<T>(tp, this);
-        return c_ != NULL;
+	return connect(true);
     }
     inline bool connected() const {
-	return c_ != NULL && !c_->error();
+	return local_ != NULL || (c_ != NULL && !c_->error());
     }
     inline int noutstanding() const {
-	return noutstanding_;
+	return noutstanding_ + (local_ ? local_->noutstanding() : 0);
+    }
+    // nothing outstanding and nothing left to write
+    inline bool idle() const {
+	return noutstanding() == 0 && (!c_ || c_->out_bytes() == 0);
     }
     inline void flush() {
-	c_->flush(NULL);
+	if (local_)
+	    local_->flush();
+	else
+	    c_->flush(NULL);
     }
     inline void shutdown() {
-	c_->shutdown();
+	if (c_)
+	    c_->shutdown();
+    }
+    // Send all calls to services of @a s, which is in this process,
+    // instead of connecting. Must be called before any call.
+    void set_local(inproc_server<T>* s) {
+	mandatory_assert(c_ == NULL && local_ == NULL);
+	local_ = new inproc_link<T>(s);
+    }
+    // see async_buffered_transport::set_watermarks
+    void set_watermarks(size_t high, size_t low) {
+	high_wm_ = high;
+	low_wm_ = low;
+	if (c_)
+	    c_->set_watermarks(high, low);
+    }
+    inline bool throttled() const {
+	return c_ != NULL && c_->throttled();
+    }
+    // Complete calls still waiting for their reply @a seconds after they
+    // were made with process_timeout (see gcrequest_base::set_deadline).
+    // 0, the default, waits until the connection fails. Calls sent to a
+    // local server are not timed.
+    void set_timeout(double seconds) {
+	timeout_ = uint64_t(seconds * 1000000);
+    }
+    // the same for calls to @a proc only; a negative value goes back to
+    // the default
+    void set_timeout(uint32_t proc, double seconds) {
+	if (proc >= timeouts_.size())
+	    timeouts_.resize(proc + 1, use_default);
+	timeouts_[proc] = seconds < 0 ? use_default : uint64_t(seconds * 1000000);
+    }
+    // calls completed by their deadline
+    inline uint64_t ntimeouts() const {
+	return ntimeouts_;
+    }
+    // Send the time left until a call's deadline with the request. Off
+    // by default: a server older than that reads such a request as a
+    // corrupt message, so upgrade the servers first.
+    void set_tell_deadline(bool on) {
+	tell_deadline_ = on;
+    }
+    // Give up on the call of @a h: it completes at once with
+    // process_cancel, and with set_tell_cancel the server is told so that
+    // it can stop early (see grequest_base::cancelled). False if the call
+    // is no longer waiting for its reply, or @a h is not of this
+    // connection. Call it on this connection's thread.
+    bool cancel(call_handle h);
+    // Send cancel frames. Off by default: a server older than them takes
+    // one for a request and runs it, so upgrade the servers first.
+    void set_tell_cancel(bool on) {
+	tell_cancel_ = on;
+    }
+    // calls given up on with cancel
+    inline uint64_t ncancelled() const {
+	return ncancelled_;
+    }
+    // replies that matched no waiting call, e.g. of calls given up on
+    inline uint64_t nstale() const {
+	return nstale_;
+    }
+    // Requests received (as a server) so far
+    inline uint64_t nserved() const {
+	return nserved_;
+    }
+
+    // Move this connection to @a to, the loop of another thread. Reading
+    // stops at once; calls being served finish on this thread and their
+    // replies go out from the new one, as do calls waiting for a reply.
+    // Then the current handler gets handle_detached, and @a adopt runs on
+    // @a to's thread, where it must set_handler. Call it on this
+    // connection's thread, outside its callbacks. Returns false if the
+    // connection cannot move: not connected yet, local, or moving.
+    bool migrate(nn_loop* to, std::function<void(async_rpcc<T>*)> adopt);
+    inline bool migrating() const {
+	return to_ != NULL;
+    }
+    void set_handler(rpc_handler<T>* rh, proc_counters<app_param::nproc, true> *counts) {
+	rh_ = rh;
+	counts_ = counts;
+    }
+
+    // Fail connections still not established @a seconds after connect().
+    // 0, the default, leaves it to the kernel.
+    void set_connect_timeout(double seconds) {
+	connect_timeout_ = seconds;
     }
 
     void buffered_read(async_buffered_transport<T> *c, uint8_t *buf, uint32_t len);
+    void call_expired(gcrequest_base* q);
     void handle_error(async_buffered_transport<T> *c, int the_errno);
+    void handle_throttle(async_buffered_transport<T> *c, bool throttled) {
+	if (rh_)
+	    rh_->handle_throttle(this, throttled);
+    }
 
     // write reply. Connection may have error
     template <typename M>
     void write_reply(uint32_t proc, uint32_t seq, M& message, uint64_t latency);
+    // the request @a seq being handled gets no reply
+    void drop_request(uint32_t seq) {
+	request_done();
+	if (connected())
+	    c_->drop(seq);
+    }
+    // whether the client cancelled the request @a seq being served
+    inline bool cancelled(uint32_t seq) const {
+	return !cancelled_.empty() && cancelled_.count(seq);
+    }
 
     void* caller_arg_;
 
   protected:
     template <uint32_t PROC>
-    inline void buffered_call(gcrequest_iface<PROC> *q);
+    inline call_handle buffered_call(gcrequest_typed<PROC> *q);
+    tcp_provider* provider() const {
+	return tcpp_;
+    }
+    // send @a q, which has been issued before, with a new sequence number.
+    // Must be connected
+    void resend(gcrequest_base *q);
+    // Schedule the deadline of @a q, the connection's timeout for the
+    // PROC unless it has its own, with @a owner. False if it has passed
+    // already; @a q is then completed.
+    bool schedule_deadline(gcrequest_base* q, call_owner* owner);
+    // @a q, whose deadline some other owner scheduled, expired
+    void expired_elsewhere(gcrequest_base* q) {
+	++ntimeouts_;
+	q->process_timeout();
+    }
 
   private:
     tcp_provider* tcpp_;
     async_buffered_transport<T>* c_;
-    gcrequest_base **waiting_;
-    unsigned waiting_capmask_;
-    uint32_t seq_;
+    inproc_link<T>* local_;
+    waiting_table waiting_;
+    uint64_t nstale_;
+    enum { use_default = uint64_t(-1) };
+    uint64_t timeout_;
+    std::vector<uint64_t> timeouts_;  // per PROC, in microseconds
+    uint64_t ntimeouts_;
+    bool tell_deadline_;
+    uint64_t ncancelled_;
+    bool tell_cancel_;
     rpc_handler<T>* rh_;
     int noutstanding_;
+    int nserving_;      // requests received but not yet replied to
+    uint64_t nserved_;
+    std::unordered_set<uint32_t> cancelled_;  // requests being served
     proc_counters<app_param::nproc, true> *counts_;
+    size_t high_wm_;
+    size_t low_wm_;
+    double connect_timeout_;
+    int connecting_fd_;
+    ev::timer connect_timer_;
+    ev::io connect_io_;
+    nn_loop* to_;  // moving there
+    std::function<void(async_rpcc<T>*)> adopt_;
+    ev::timer handoff_;
 
-    void expand_waiting();
+    bool connect(bool notify);
+    void connect_expired(ev::timer&, int);
+    void connect_done(ev::io&, int);
+    void handoff(ev::timer&, int);
+    bool track(gcrequest_base* q);
+    void cancel_migration();
 
     // write request. Connection must have no error
     template <typename M>
-    inline void write_request(uint32_t proc, uint32_t seq, M& message);
+    inline void write_request(uint32_t proc, uint32_t seq, M& message, uint64_t deadline);
+    uint8_t* start_request(uint32_t proc, uint32_t seq, uint32_t req_sz, uint64_t deadline);
+    void request_done();
 };
 
 template <typename T>
 template <uint32_t PROC>
-void async_rpcc<T>::buffered_call(gcrequest_iface<PROC> *q) {
+call_handle async_rpcc<T>::buffered_call(gcrequest_typed<PROC> *q) {
+    if (local_) {
+	local_->call(q);
+	return call_handle();
+    }
     if (!connected()) {
 	q->process_connection_error();
+	return call_handle();
+    }
+    if (!track(q))
+	return call_handle();
+    write_request(PROC, q->seq_, q->req(), q->deadline());
+    return call_handle(this, q->seq_);
+}
+
+template <typename T>
+void async_rpcc<T>::resend(gcrequest_base *q) {
+    mandatory_assert(connected() && !local_);
+    if (!track(q))
 	return;
+    uint32_t req_sz = q->request_size();
+    uint8_t *x = start_request(q->proc(), q->seq_, req_sz, q->deadline());
+    q->serialize_request(x, req_sz);
+}
+
+// Put @a q in waiting_ and schedule its deadline. False if @a q has been
+// completed instead.
+template <typename T>
+bool async_rpcc<T>::track(gcrequest_base *q) {
+    if (!schedule_deadline(q, this))
+	return false;
+    if (!waiting_.insert(q, q->seq_)) {
+	nn_loop::get_tls_loop()->timers().cancel(q);
+	q->process_connection_error();
+	return false;
+    }
+    return true;
+}
+
+template <typename T>
+bool async_rpcc<T>::schedule_deadline(gcrequest_base *q, call_owner* owner) {
+    if (!q->deadline()) {
+	uint64_t t = q->proc() < timeouts_.size() && timeouts_[q->proc()] != use_default
+	    ? timeouts_[q->proc()] : timeout_;
+	if (t)
+	    q->set_deadline(q->start_at() + t);
+    }
+    if (q->deadline() && q->deadline() <= rpc::common::tstamp()) {
+	++ntimeouts_;
+	q->process_timeout();
+	return false;
+    }
+    if (q->deadline()) {
+	q->owner_ = owner;
+	nn_loop::get_tls_loop()->timers().schedule(q, q->deadline());
+    }
+    return true;
+}
+
+template <typename T>
+bool async_rpcc<T>::cancel(call_handle h) {
+    if (h.owner_ != this)
+	return false;
+    gcrequest_base *q = waiting_.remove(h.seq_);
+    if (!q)
+	return false;
+    nn_loop::get_tls_loop()->timers().cancel(q);
+    --noutstanding_;
+    ++ncancelled_;
+    if (connected()) {
+	c_->drop(h.seq_);
+	if (tell_cancel_) {
+	    uint8_t *x = c_->reserve(sizeof(rpc_header));
+	    rpc_header *ch = reinterpret_cast<rpc_header *>(x);
+	    ch->set_payload_length(0, true);
+	    ch->seq_ = h.seq_;
+	    ch->set_mproc(rpc_header::make_mproc(q->proc(), 0));
+	    ch->set_cancel();
+	}
     }
-    ++seq_;
-    q->seq_ = seq_;
-    write_request(PROC, seq_, q->req());
-    if (waiting_[seq_ & waiting_capmask_])
-	expand_waiting();
-    waiting_[seq_ & waiting_capmask_] = q;
+    // a reply already on its way is counted in nstale
+    q->process_cancel();
+    return true;
+}
+
+template <typename T>
+void async_rpcc<T>::call_expired(gcrequest_base *q) {
+    mandatory_assert(waiting_.remove(q->seq_) == q);
+    --noutstanding_;
+    ++ntimeouts_;
+    // a late reply is counted in nstale
+    q->process_timeout();
 }
 
 template <typename T>
 template <typename M>
-inline void async_rpcc<T>::write_request(uint32_t proc, uint32_t seq, M& message) {
-    check_unaligned_access();
+inline void async_rpcc<T>::write_request(uint32_t proc, uint32_t seq, M& message,
+					 uint64_t deadline) {
     // write_request doesn't need to handle connection failure
     // the call method won't call write_request if not connected
     mandatory_assert(connected());
     uint32_t req_sz = message.ByteSize();
-    uint8_t *x = c_->reserve(sizeof(rpc_header) + req_sz);
+    uint8_t *x = start_request(proc, seq, req_sz, deadline);
+    message.SerializeToArray(x, req_sz);
+}
+
+// Reserve the frame of a request with @a req_sz bytes of message, and
+// returns where the message goes. The time left until @a deadline, if
+// any, travels with it if set_tell_deadline allows.
+template <typename T>
+uint8_t* async_rpcc<T>::start_request(uint32_t proc, uint32_t seq, uint32_t req_sz,
+				      uint64_t deadline) {
+    check_unaligned_access();
+    if (!tell_deadline_)
+	deadline = 0;
+    uint32_t ext = deadline ? sizeof(uint32_t) : 0;
+    uint8_t *x = c_->reserve(sizeof(rpc_header) + ext + req_sz);
     rpc_header *h = reinterpret_cast<rpc_header *>(x);
-    h->set_payload_length(req_sz, true);
+    h->set_payload_length(ext + req_sz, true);
     h->seq_ = seq;
     h->set_mproc(rpc_header::make_mproc(proc, 0));
-    message.SerializeToArray(x + sizeof(*h), req_sz);
+    if (deadline) {
+	uint64_t now = rpc::common::tstamp();
+	uint64_t left = deadline > now ? deadline - now : 1;
+	h->set_budget(std::min(left, uint64_t(UINT32_MAX)));
+    }
     ++noutstanding_;
     if (counts_)
-	counts_->add(proc, count_sent_request, sizeof(rpc_header) + req_sz);
+	counts_->add(proc, count_sent_request, sizeof(rpc_header) + ext + req_sz);
+    return x + sizeof(*h) + ext;
 }
 
 template <typename T>
 template <typename M>
 void async_rpcc<T>::write_reply(uint32_t proc, uint32_t seq, M& message, uint64_t latency) {
     check_unaligned_access();
-    --noutstanding_;
+    bool cancelled = !cancelled_.empty() && cancelled_.erase(seq);
+    request_done();
     // write_reply need to handle connection failure because the caller
     // doesn't know
     if (!connected())
 	return;
+    if (cancelled) {
+	c_->drop(seq);
+	return;
+    }
     uint32_t reply_sz = message.ByteSize();
     uint8_t *x = c_->reserve(sizeof(rpc_header) + reply_sz);
     rpc_header *h = reinterpret_cast<rpc_header *>(x);
@@ -140,37 +400,58 @@ void async_rpcc<T>::write_reply(uint32_t proc, uint32_t seq, M& message, uint64_
     }
 }
 
+template <typename T>
+void async_rpcc<T>::request_done() {
+    --noutstanding_;
+    if (--nserving_ == 0) {
+	// including cancels that came after the reply went out
+	if (!cancelled_.empty())
+	    cancelled_.clear();
+	if (to_)
+	    handoff_.start(0);
+    }
+}
+
 template <typename T>
 async_rpcc<T>::async_rpcc(tcp_provider* tcpp, 
 		       rpc_handler<T>* rh, bool force_connected,
 		       proc_counters<app_param::nproc, true> *counts)
-    : caller_arg_(), tcpp_(tcpp), c_(NULL),
-      waiting_(new gcrequest_base *[1024]), waiting_capmask_(1023), 
-      seq_(random() / 2), rh_(rh), noutstanding_(0), counts_(counts) {
-    bzero(waiting_, sizeof(gcrequest_base *) * 1024);
+    : caller_arg_(), tcpp_(tcpp), c_(NULL), local_(NULL), nstale_(0),
+      timeout_(0), ntimeouts_(0), tell_deadline_(false), ncancelled_(0), tell_cancel_(false), rh_(rh), noutstanding_(0), nserving_(0), nserved_(0),
+      counts_(counts), high_wm_(0), low_wm_(0), connect_timeout_(0),
+      connecting_fd_(-1), to_(NULL) {
     if (force_connected)
-	mandatory_assert(connect());
+	mandatory_assert(connect(false));
 }
 
 template <typename T>
 async_rpcc<T>::~async_rpcc() {
-    mandatory_assert(!noutstanding_);
-    delete[] waiting_;
+    mandatory_assert(!noutstanding());
+    connect_timer_.stop();
+    connect_io_.stop();
+    handoff_.stop();
     delete tcpp_;
     if (c_)
         delete c_;
+    if (local_)
+	delete local_;
 }
 
 template <typename T>
 void async_rpcc<T>::buffered_read(async_buffered_transport<T> *, uint8_t *buf, uint32_t len) {
     parser p;
+    uint64_t arrived = 0;
     while (p.parse<rpc_header>(buf, len, c_)) {
 	rpc_header *rhdr = p.header<rpc_header>();
         if (!rhdr->request()) {
             // Find the rpc request with sequence number @reply_hdr_.seq
-	    gcrequest_base *q = waiting_[rhdr->seq_ & waiting_capmask_];
-            mandatory_assert(q && q->seq_ == rhdr->seq_ && "RPC reply but no waiting call");
-	    waiting_[rhdr->seq_ & waiting_capmask_] = 0;
+	    gcrequest_base *q = waiting_.remove(rhdr->seq_, rhdr->proc());
+	    if (!q) {
+		++nstale_;
+		p.reset();
+		continue;
+	    }
+	    nn_loop::get_tls_loop()->timers().cancel(q);
 	    --noutstanding_;
 	    gcrequest_base::last_server_latency_ = rhdr->latency();
 	    // update counts_ before process_reply, which will delete itself
@@ -180,50 +461,166 @@ void async_rpcc<T>::buffered_read(async_buffered_transport<T> *, uint8_t *buf, u
 		counts_->add_latency(q->proc(), rpc::common::tstamp() - q->start_at());
 	    }
 	    q->process_reply(p);
+        } else if (rhdr->cancel()) {
+            if (nserving_)
+                cancelled_.insert(rhdr->seq_);
         } else {
+            // a cancel that came too late is void once the seq is reused
+            if (!cancelled_.empty())
+                cancelled_.erase(rhdr->seq_);
             ++noutstanding_;
+            ++nserving_;
+            ++nserved_;
+            // the budget counts from when the request was read
+            if (rhdr->has_budget()) {
+                if (!arrived)
+                    arrived = rpc::common::tstamp();
+                p.deadline_ = arrived + rhdr->budget();
+            }
             mandatory_assert(rh_);
             rh_->handle_rpc(this, p);
         }
         p.reset();
     }
+    if (p.bad_) {
+	fprintf(stderr, "async_rpcc: malformed frame\n");
+	c_->reject(EPROTO);
+    }
 }
 
 template <typename T>
 void async_rpcc<T>::handle_error(async_buffered_transport<T> *c, int the_errno) {
     mandatory_assert(c == c_);
+    connect_timer_.stop();
+    connect_io_.stop();
+    cancel_migration();
+    if (c->throttled() && rh_)
+	rh_->handle_throttle(this, false);
     c_ = NULL;
     if (rh_)
         rh_->handle_client_failure(this);
     if (noutstanding_ != 0)
 	fprintf(stderr, "error: %d rpcs outstanding (%s)\n",
 		noutstanding_, strerror(the_errno));
-    unsigned ncap = waiting_capmask_ + 1;
-    for (unsigned i = 0; i < ncap; ++i) {
-        gcrequest_base* q = waiting_[i];
-        if (q) {
+    waiting_.clear([this](gcrequest_base* q) {
+	    nn_loop::get_tls_loop()->timers().cancel(q);
 	    --noutstanding_;
-            q->process_connection_error();
-	}
-    }
+	    if (!rh_ || !rh_->handle_lost_call(this, q))
+		q->process_connection_error();
+	});
     delete c;
     if (rh_)
 	rh_->handle_post_failure(this);
 }
 
 template <typename T>
-void async_rpcc<T>::expand_waiting() {
-    do {
-	unsigned ncapmask = waiting_capmask_ * 2 + 1;
-	gcrequest_base **nw = new gcrequest_base *[ncapmask + 1];
-	memset(nw, 0, sizeof(gcrequest_base *) * (ncapmask + 1));
-	for (unsigned i = 0; i <= waiting_capmask_; ++i)
-	    if (gcrequest_base *rr = waiting_[i])
-		nw[rr->seq_ & ncapmask] = rr;
-	delete[] waiting_;
-	waiting_ = nw;
-	waiting_capmask_ = ncapmask;
-    } while (waiting_[seq_ & waiting_capmask_]);
+bool async_rpcc<T>::connect(bool notify) {
+    if (local_)
+	return true;
+    mandatory_assert(c_ == NULL);
+    // Where the provider allows it, the handshake completes in the
+    // background. Calls made meanwhile are buffered and sent once the
+    // socket is writable (or, with fast open, in the SYN).
+    bool in_progress = false;
+    int fd = has_async_connect<T>::value ? tcpp_->connect_nonblock(in_progress)
+	: tcpp_->connect();
+    if (fd < 0) {
+	fprintf(stderr, "async_rpcc: failed to connect\n");
+	return false;
+    }
+    typedef typename T::async_transport transport;
+    transport* tp = T::template make<transport>(fd);
+    if (tp) {
+	c_ = new async_buffered_transport<T>(tp, this);
+	c_->set_watermarks(high_wm_, low_wm_);
+	connecting_fd_ = fd;
+	if (in_progress && connect_timeout_ > 0) {
+	    connect_timer_.set(nn_loop::get_tls_loop()->ev_loop());
+	    connect_timer_.set<async_rpcc<T>, &async_rpcc<T>::connect_expired>(this);
+	    connect_timer_.start(connect_timeout_);
+	}
+	// a fast open handshake waits for the first request
+	if (in_progress && !rpc::common::sock_helper::fastopen()) {
+	    connect_io_.set(nn_loop::get_tls_loop()->ev_loop());
+	    connect_io_.set<async_rpcc<T>, &async_rpcc<T>::connect_done>(this);
+	    connect_io_.start(fd, ev::WRITE);
+	} else if (notify && rh_)
+	    rh_->handle_connected(this);
+    }
+    return c_ != NULL;
+}
+
+template <typename T>
+void async_rpcc<T>::connect_done(ev::io&, int) {
+    connect_io_.stop();
+    // on failure, the transport reports the error
+    if (rpc::common::sock_helper::established(connecting_fd_)) {
+	connect_timer_.stop();
+	if (rh_)
+	    rh_->handle_connected(this);
+    }
+}
+
+template <typename T>
+void async_rpcc<T>::connect_expired(ev::timer&, int) {
+    if (rpc::common::sock_helper::established(connecting_fd_))
+	return;
+    // a fast open connection sends its SYN with the first request
+    if (rpc::common::sock_helper::fastopen() && noutstanding_ == 0) {
+	connect_timer_.start(connect_timeout_);
+	return;
+    }
+    fprintf(stderr, "async_rpcc: connect timed out\n");
+    c_->fail(ETIMEDOUT);
+}
+
+template <typename T>
+bool async_rpcc<T>::migrate(nn_loop* to, std::function<void(async_rpcc<T>*)> adopt) {
+    mandatory_assert(can_migrate<T>::value);
+    if (local_ || !connected() || to_ || connect_io_.is_active()
+	|| connect_timer_.is_active())
+	return false;
+    to_ = to;
+    adopt_ = adopt;
+    c_->pause(true);
+    handoff_.set(nn_loop::get_tls_loop()->ev_loop());
+    handoff_.set<async_rpcc<T>, &async_rpcc<T>::handoff>(this);
+    if (nserving_ == 0)
+	handoff_.start(0);
+    return true;
+}
+
+template <typename T>
+void async_rpcc<T>::handoff(ev::timer&, int) {
+    if (rh_)
+	rh_->handle_detached(this);
+    rh_ = NULL;
+    counts_ = NULL;
+    c_->detach();
+    // deadlines move to the new loop's wheel
+    timer_wheel& w = nn_loop::get_tls_loop()->timers();
+    waiting_.for_each([&w](gcrequest_base* q) {
+	    w.cancel(q);
+	});
+    to_->post([this] {
+	    std::function<void(async_rpcc<T>*)> adopt;
+	    adopt.swap(adopt_);
+	    to_ = NULL;
+	    c_->attach();
+	    timer_wheel& w = nn_loop::get_tls_loop()->timers();
+	    waiting_.for_each([&w](gcrequest_base* q) {
+		    if (q->deadline())
+			w.schedule(q, q->deadline());
+		});
+	    adopt(this);
+	});
+}
+
+template <typename T>
+void async_rpcc<T>::cancel_migration() {
+    handoff_.stop();
+    to_ = NULL;
+    adopt_ = nullptr;
 }
 
 
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <deque>
+#include <functional>
+#include <memory>
+#include <algorithm>
 #include "rpc_common/compiler.hh"
 #include "libev_loop.hh"
 #include "async_rpcc.hh"
@@ -12,6 +16,9 @@ namespace rpc {
  *   - on failure, the connection will first be disconnected, then all
  *     the outstanding requests will be called to complete with its eno
  *     set to RPCERR.
+ *   - with set_reconnect, it reconnects after failures. Calls made while
+ *     reconnecting, and outstanding calls that the resend policy accepts,
+ *     are held (up to a limit) and sent once connected instead.
  */
 template <typename T>
 class async_batched_rpcc : public rpc_handler<T>, public async_rpcc<T> {
@@ -19,7 +26,57 @@ class async_batched_rpcc : public rpc_handler<T>, public async_rpcc<T> {
     async_batched_rpcc(const char* rmt, int rmtport, int w,
 		       const char* local = "0.0.0.0", bool force_connected = true)
 	: async_rpcc<T>(new multi_tcpp(rmt, local, rmtport), this, force_connected, NULL), 
-          loop_(nn_loop::get_tls_loop()), w_(w) {
+          loop_(nn_loop::get_tls_loop()), w_(w), reconnect_(loop_->ev_loop()),
+          min_delay_(0), max_delay_(0), max_held_(0), delay_(0), up_since_(0),
+          reconnecting_(false), self_(new async_batched_rpcc<T>*(this)),
+          held_expiry_(this) {
+    }
+    // e.g. unix_tcpp for a unixnet server
+    async_batched_rpcc(tcp_provider* tcpp, int w, bool force_connected = true)
+	: async_rpcc<T>(tcpp, this, force_connected, NULL),
+          loop_(nn_loop::get_tls_loop()), w_(w), reconnect_(loop_->ev_loop()),
+          min_delay_(0), max_delay_(0), max_held_(0), delay_(0), up_since_(0),
+          reconnecting_(false), self_(new async_batched_rpcc<T>*(this)),
+          held_expiry_(this) {
+    }
+    // calls services of a server in this process, see async_rpcc::set_local
+    async_batched_rpcc(inproc_server<T>* s, int w)
+	: async_rpcc<T>(NULL, this, false, NULL),
+          loop_(nn_loop::get_tls_loop()), w_(w), reconnect_(loop_->ev_loop()),
+          min_delay_(0), max_delay_(0), max_held_(0), delay_(0), up_since_(0),
+          reconnecting_(false), self_(new async_batched_rpcc<T>*(this)),
+          held_expiry_(this) {
+	this->set_local(s);
+    }
+    ~async_batched_rpcc() {
+	reconnect_.stop();
+	fail_held();
+    }
+    // After a failure, reconnect in @a min_delay seconds, doubling the
+    // delay up to @a max_delay while attempts keep failing. Each delay
+    // is drawn between half and all of it, so that clients of the same
+    // server spread out. Up to @a max_held calls wait for the connection;
+    // they fail when an attempt made after the longest delay fails too,
+    // or time out at their deadlines.
+    void set_reconnect(double min_delay, double max_delay, size_t max_held) {
+	mandatory_assert(min_delay > 0 && min_delay <= max_delay);
+	min_delay_ = min_delay;
+	max_delay_ = max_delay;
+	max_held_ = max_held;
+	reconnect_.set<async_batched_rpcc<T>, &async_batched_rpcc<T>::reconnect>(this);
+    }
+    // Whether a call that was outstanding when the connection failed may
+    // be sent again. The default resends nothing, since the server may
+    // have executed it.
+    void set_resend_policy(std::function<bool(gcrequest_base*)> resend) {
+	resend_ = resend;
+    }
+    // between a failure and the next established connection
+    bool reconnecting() const {
+	return reconnecting_;
+    }
+    int noutstanding() const {
+	return async_rpcc<T>::noutstanding() + held_.size();
     }
     bool drain() {
         mandatory_assert(loop_->enter() == 1,
@@ -37,13 +94,45 @@ class async_batched_rpcc : public rpc_handler<T>, public async_rpcc<T> {
     void handle_client_failure(async_rpcc<T>* c) {
 	mandatory_assert(c == static_cast<async_rpcc<T>*>(this));
     }
+    bool handle_lost_call(async_rpcc<T>*, gcrequest_base* q) {
+	if (!min_delay_ || held_.size() >= max_held_ || !resend_ || !resend_(q))
+	    return false;
+	hold(q);
+	return true;
+    }
     void handle_post_failure(async_rpcc<T>* c) {
 	mandatory_assert(c == static_cast<async_rpcc<T>*>(this));
+	if (!min_delay_)
+	    return;
+	// a connection that outlived the longest delay starts over
+	if (up_since_ && rpc::common::tstamp() - up_since_ > max_delay_ * 1000000)
+	    delay_ = 0;
+	up_since_ = 0;
+	reconnecting_ = true;
+	schedule();
     }
+    void handle_connected(async_rpcc<T>*) {
+	up_since_ = rpc::common::tstamp();
+	reconnecting_ = false;
+	reconnect_.stop();
+	while (!held_.empty()) {
+	    gcrequest_base* q = held_.front();
+	    held_.pop_front();
+	    nn_loop::get_tls_loop()->timers().cancel(q);
+	    this->resend(q);
+	}
+    }
+    // The handle cancels the call (see async_rpcc::cancel), unless it is
+    // held for a reconnection or made to a local server.
     template <uint32_t PROC>
-    inline void call(gcrequest_iface<PROC> *q) {
-	this->buffered_call(q);
+    inline call_handle call(gcrequest_typed<PROC> *q) {
+	if (reconnecting() && held_.size() < max_held_) {
+	    hold(q);
+	    return call_handle();
+	}
+	call_handle h = this->buffered_call(q);
 	winctrl();
+	return h;
     }
 
   protected:
@@ -62,6 +151,66 @@ class async_batched_rpcc : public rpc_handler<T>, public async_rpcc<T> {
   private:
     nn_loop *loop_;
     int w_;
+    ev::timer reconnect_;
+    double min_delay_;
+    double max_delay_;
+    size_t max_held_;
+    double delay_;       // of the last attempt, 0 after a success
+    uint64_t up_since_;  // when the current connection was established
+    bool reconnecting_;
+    std::function<bool(gcrequest_base*)> resend_;
+    std::deque<gcrequest_base*> held_;
+    std::shared_ptr<async_batched_rpcc<T>*> self_;  // for late callbacks
+    // times out held calls
+    struct held_expiry : public call_owner {
+	held_expiry(async_batched_rpcc<T>* c) : c_(c) {
+	}
+	void call_expired(gcrequest_base* q) {
+	    c_->held_expired(q);
+	}
+	async_batched_rpcc<T>* c_;
+    } held_expiry_;
+
+    void hold(gcrequest_base* q) {
+	if (this->schedule_deadline(q, &held_expiry_))
+	    held_.push_back(q);
+    }
+    void held_expired(gcrequest_base* q) {
+	held_.erase(std::find(held_.begin(), held_.end(), q));
+	this->expired_elsewhere(q);
+    }
+    void schedule() {
+	if (delay_ >= max_delay_)
+	    fail_held();
+	delay_ = delay_ ? std::min(delay_ * 2, max_delay_) : min_delay_;
+	double d = delay_ / 2 + delay_ / 2 * (random() / (RAND_MAX + 1.0));
+	reconnect_.start(d);
+    }
+    void reconnect(ev::timer&, int) {
+	if (this->connected())
+	    return;
+	// resolve the host off the loop first
+	std::weak_ptr<async_batched_rpcc<T>*> w = self_;
+	auto cb = [w] {
+	    if (auto p = w.lock())
+		(*p)->resolved();
+	};
+	if (this->provider()->ready(cb))
+	    resolved();
+    }
+    void resolved() {
+	// held calls go out in handle_connected
+	if (!this->connected() && !this->connect())
+	    schedule();
+    }
+    void fail_held() {
+	while (!held_.empty()) {
+	    gcrequest_base* q = held_.front();
+	    held_.pop_front();
+	    nn_loop::get_tls_loop()->timers().cancel(q);
+	    q->process_connection_error();
+	}
+    }
 };
 
 template <typename T>
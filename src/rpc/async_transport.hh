@@ -5,10 +5,16 @@
 #include "proc_counters.hh"
 #include "proto/fastrpc_proto.hh"
 #include "tcp.hh"
+#include "tcp_provider.hh"
 #include <errno.h>
 #include <string.h>
 #include <ev++.h>
 #include <malloc.h>
+#include <algorithm>
+#include <vector>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 
 #include <boost/intrusive/slist.hpp>
 namespace bi = boost::intrusive;
@@ -21,36 +27,188 @@ template <typename T>
 struct transport_handler {
     virtual void buffered_read(async_buffered_transport<T>*, uint8_t* buf, uint32_t len) = 0;
     virtual void handle_error(async_buffered_transport<T>*, int the_errno) = 0;
+    // the transport stopped (or resumed) reading because of its watermarks
+    virtual void handle_throttle(async_buffered_transport<T>*, bool throttled) {}
 };
 
+// Transport buffers start in the smallest buffer_pool class, so a quiet
+// connection holds 4KB, and double up to this many bytes while it keeps
+// filling them.
+enum { buffer_grow_limit = 65536 };
+
+/** Output buffer, carved from the loop's buffer_pool */
 struct outbuf : public bi::slist_base_hook<> {
     static outbuf* make(uint32_t size) {
-        if (size < 65520 - sizeof(outbuf))
-	    size = 65520 - sizeof(outbuf);
-        outbuf *x = new (malloc(size + sizeof(outbuf))) outbuf;
-        x->capacity = size;
+	size_t n = std::max(size_t(size) + sizeof(outbuf), buffer_pool::class_size(0));
+        outbuf *x = new (nn_loop::get_tls_loop()->buffers().alloc(n)) outbuf;
+        x->capacity = n - sizeof(outbuf);
         x->head = x->tail = 0;
+        x->zc = false;
         return x;
     }
     static void free(outbuf* x) {
-	delete x;
+	size_t n = x->capacity + sizeof(outbuf);
+	x->~outbuf();
+	nn_loop::get_tls_loop()->buffers().release(x, n);
     }
     uint32_t capacity;
     uint32_t head;
     uint32_t tail;
+    uint32_t zc_id;  // last zero-copy send that covered this buffer
+    bool zc;
     uint8_t buf[0];
   private:
     outbuf() {}
 };
 
+/** Input buffer. [head, tail) holds received bytes that are not yet
+    parsed, and reads go to [tail, end()). A mirrored inbuf maps the same
+    pages twice, back to back, so a frame that wraps around the end of
+    the ring is still contiguous and partial frames are never moved. */
+struct inbuf {
+    static inbuf* make(uint32_t size, bool mirrored) {
+	if (mirrored) {
+	    inbuf* x = make_mirrored(size);
+	    if (x)
+		return x;
+	}
+	size_t n = std::max(size_t(size) + sizeof(inbuf), buffer_pool::class_size(0));
+	inbuf *x = new (nn_loop::get_tls_loop()->buffers().alloc(n)) inbuf;
+	x->buf = reinterpret_cast<uint8_t*>(x + 1);
+	x->capacity = n - sizeof(inbuf);
+	x->head = x->tail = 0;
+	x->mirrored = x->exact = false;
+	return x;
+    }
+    // exactly @a size bytes, from malloc rather than a pool size class
+    static inbuf* make_exact(uint32_t size) {
+	void* p = malloc(sizeof(inbuf) + size);
+	mandatory_assert(p);
+	inbuf *x = new (p) inbuf;
+	x->buf = reinterpret_cast<uint8_t*>(x + 1);
+	x->capacity = size;
+	x->head = x->tail = 0;
+	x->mirrored = false;
+	x->exact = true;
+	return x;
+    }
+    static void free(inbuf* x) {
+	if (x->mirrored) {
+	    munmap(x->buf, size_t(x->capacity) * 2);
+	    delete x;
+	} else if (x->exact) {
+	    x->~inbuf();
+	    ::free(x);
+	} else
+	    nn_loop::get_tls_loop()->buffers().release(x, x->capacity + sizeof(inbuf));
+    }
+    // from the loop's buffer_pool
+    bool pooled() const {
+	return !mirrored && !exact;
+    }
+    // still below buffer_grow_limit
+    bool growable() const {
+	return !exact && capacity + (mirrored ? 0 : sizeof(inbuf)) < size_t(buffer_grow_limit);
+    }
+    // end of the region addressable from head
+    uint32_t end() const {
+	return mirrored ? head + capacity : capacity;
+    }
+    // a mirrored inbuf keeps head within the first mapping
+    void wrap() {
+	if (mirrored && head >= capacity) {
+	    head -= capacity;
+	    tail -= capacity;
+	}
+    }
+    uint8_t* buf;
+    uint32_t capacity;
+    uint32_t head;
+    uint32_t tail;
+    bool mirrored;
+    bool exact;
+  private:
+    inbuf() {}
+    static inbuf* make_mirrored(uint32_t size) {
+	size_t pgsz = sysconf(_SC_PAGESIZE);
+	size_t cap = std::max(size_t(size), buffer_pool::class_size(0));
+	cap = (cap + pgsz - 1) / pgsz * pgsz;
+	int fd = memfd_create("fastrpc-inbuf", MFD_CLOEXEC);
+	if (fd < 0)
+	    return NULL;
+	uint8_t* base = NULL;
+	if (ftruncate(fd, cap) == 0)
+	    base = (uint8_t*)mmap(NULL, cap * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+	    base = NULL;
+	if (base && (mmap(base, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+		     || mmap(base + cap, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+	    munmap(base, cap * 2);
+	    base = NULL;
+	}
+	close(fd);
+	if (!base)
+	    return NULL;
+	inbuf* x = new inbuf;
+	x->buf = base;
+	x->capacity = cap;
+	x->head = x->tail = 0;
+	x->mirrored = true;
+	x->exact = false;
+	return x;
+    }
+};
+
+template <typename X>
+void detach_transport(X* tp, std::true_type) {
+    tp->detach();
+}
+template <typename X>
+void detach_transport(X*, std::false_type) {
+    mandatory_assert(0 && "the transport cannot migrate");
+}
+
+template <typename X>
+void drop_transport_request(X* tp, uint32_t seq, std::true_type) {
+    tp->drop(seq);
+}
+template <typename X>
+void drop_transport_request(X*, uint32_t, std::false_type) {
+}
+
+template <typename X>
+uint32_t transport_zerocopy_threshold(X* tp, std::true_type) {
+    return tp->zerocopy_threshold();
+}
+template <typename X>
+uint32_t transport_zerocopy_threshold(X*, std::false_type) {
+    return 0;
+}
+template <typename X>
+ssize_t transport_writev_zerocopy(X* tp, const struct iovec* iov, int iovcnt, std::true_type) {
+    return tp->writev_zerocopy(iov, iovcnt);
+}
+template <typename X>
+ssize_t transport_writev_zerocopy(X* tp, const struct iovec* iov, int iovcnt, std::false_type) {
+    return tp->writev(iov, iovcnt);
+}
+template <typename X>
+bool transport_reap_zerocopy(X* tp, uint32_t& lo, uint32_t& hi, std::true_type) {
+    return tp->reap_zerocopy(lo, hi);
+}
+template <typename X>
+bool transport_reap_zerocopy(X*, uint32_t&, uint32_t&, std::false_type) {
+    return false;
+}
+
 template <typename T>
-struct async_buffered_transport {
+struct async_buffered_transport : public deferred_flusher {
     typedef typename T::async_transport transport;
 
     async_buffered_transport(transport* tp, transport_handler<T> *ioh);
     ~async_buffered_transport();
     bool error() const {
-        return tp_->ev_flags() == 0;
+        return error_;
     }
 
     // input
@@ -60,24 +218,105 @@ struct async_buffered_transport {
     inline uint8_t *reserve(uint32_t size);
 
     int flush(int* the_errno);
+    void flush_deferred();
 
     void shutdown() {
         tp_->shutdown();
     }
+    // Give up on the connection as if the transport had failed with
+    // @a the_errno. NB may delete `this`
+    void fail(int the_errno);
+    // From buffered_read: the input makes no sense. The connection
+    // fails with @a the_errno once buffered_read returns.
+    void reject(int the_errno) {
+	rejected_ = the_errno;
+    }
+    // The request @a seq read from this transport gets no reply, or the
+    // call @a seq made on it was given up on. See has_request_state.
+    void drop(uint32_t seq) {
+	drop_transport_request(tp_, seq, std::integral_constant<bool, has_request_state<T>::value>());
+    }
+
+    // Stop reading once @a high bytes of output are waiting to be sent,
+    // and resume when no more than @a low are left. 0 disables.
+    void set_watermarks(size_t high, size_t low) {
+	assert(low <= high);
+	high_wm_ = high;
+	low_wm_ = low;
+    }
+    size_t out_bytes() const {
+	return out_bytes_;
+    }
+    bool throttled() const {
+	return throttled_;
+    }
+    // Stop (or resume) reading, regardless of the watermarks.
+    void pause(bool on) {
+	paused_ = on;
+	if (!error_)
+	    select(tp_->ev_flags() & ev::WRITE);
+    }
+
+    // Moving to the loop of another thread: detach() on the current
+    // thread, then attach() on the new one. Buffered input and output
+    // go along. Needs T::migratable, see can_migrate.
+    void detach();
+    void attach();
+
+    // Whether transports created from now on use a mirrored inbuf.
+    // Pass a negative value to query.
+    static bool mirrored_inbuf(int enable = -1) {
+	static bool mirrored = false;
+	if (enable >= 0)
+	    mirrored = enable;
+	return mirrored;
+    }
+    // Frames of at least this many bytes are received into storage of
+    // exactly their size instead of a grown inbuf. Pass 0 to query.
+    static uint32_t large_frame(uint32_t threshold = 0) {
+	static uint32_t large = 1 << 20;
+	if (threshold)
+	    large = threshold;
+	return large;
+    }
 
   private:
-    outbuf *in_;
+    typedef std::integral_constant<bool, has_zerocopy<T>::value> zerocopy_type;
+    // NULL while the connection is idle; see fill()
+    inbuf *in_;
+    // the mirrored ring, set aside while in_ holds a large frame
+    inbuf *ring_;
+    bool mirrored_;
+    bool dirty_;  // queued on the loop's deferred flush list
+    bool error_;
+    bool throttled_;
+    bool paused_;
+    int rejected_;      // see reject()
+    size_t out_bytes_;  // buffered but not yet written
+    size_t high_wm_;
+    size_t low_wm_;
 
     // active output buffers. 
-    // head is write/flush end, tail is buffering end
+    // head is write/flush end, tail is buffering end.
+    // Flushed outbufs go back to the loop's buffer_pool.
     bi::slist<outbuf, bi::constant_time_size<false>, bi::cache_last<true> > out_active_;
-    bi::slist<outbuf, bi::constant_time_size<false>, bi::cache_last<false> > out_free_;
+    // written with MSG_ZEROCOPY, but the kernel may still read them
+    bi::slist<outbuf, bi::constant_time_size<false>, bi::cache_last<true> > zc_wait_;
+    uint32_t zc_next_;   // number of the next zero-copy send
+    uint32_t zc_acked_;  // all zero-copy sends before this one are done
+    std::vector<std::pair<uint32_t, uint32_t> > zc_early_;
 
     transport* tp_;
     transport_handler<T> *ioh_;
 
     bool event_handler(transport*, int e);
+    void select(bool write) {
+	tp_->eselect((throttled_ || paused_ ? 0 : ev::READ) | (write ? ev::WRITE : 0));
+    }
+    void throttle(bool on);
     int fill(int* the_errno);
+    void reap_zerocopy();
+    void move_buffers(bool adopt);
 
     void resize_inbuf(uint32_t size);
     void refill_outbuf(uint32_t size);
@@ -87,23 +326,40 @@ template <typename T>
 bool async_buffered_transport<T>::event_handler(transport*, int e) {
     int ok = 1;
     int the_errno = 0;
+    nn_loop::get_tls_loop()->count_event();
+    if (zc_next_ != zc_acked_)
+	reap_zerocopy();
     if (e & ev::READ)
 	ok = fill(&the_errno);
-    if (ok == 2 || (ok > 0 && (e & ev::WRITE)))
+    if (ok > 0 && (e & ev::WRITE))
 	ok = flush(&the_errno);
     if (ok <= 0) {
-	tp_->eselect(0);
-	ioh_->handle_error(this, the_errno); // NB may delete `this`
+	fail(the_errno);
 	return true;
     }
     return false;
 }
 
+template <typename T>
+void async_buffered_transport<T>::fail(int the_errno) {
+    error_ = true;
+    tp_->eselect(0);
+    ioh_->handle_error(this, the_errno); // NB may delete `this`
+}
+
+template <typename T>
+void async_buffered_transport<T>::throttle(bool on) {
+    throttled_ = on;
+    select(tp_->ev_flags() & ev::WRITE);
+    ioh_->handle_throttle(this, on);
+}
+
 template <typename T>
 void async_buffered_transport<T>::advance(uint8_t *head, uint32_t need_space) {
     assert(head >= in_->buf + in_->head && head <= in_->buf + in_->tail);
     in_->head = head - in_->buf;
-    if (in_->head + need_space > in_->capacity)
+    in_->wrap();
+    if (in_->head + need_space > in_->end())
 	resize_inbuf(need_space);
 }
 
@@ -113,14 +369,40 @@ uint8_t *async_buffered_transport<T>::reserve(uint32_t size) {
     outbuf& h = out_active_.back();
     uint8_t *x = h.buf + h.tail;
     h.tail += size;
-    if (size)
-	tp_->eselect(ev::READ | ev::WRITE);
+    out_bytes_ += size;
+    if (high_wm_ && !throttled_ && out_bytes_ >= high_wm_ && !error_)
+	throttle(true);
+    // Written at the end of the loop iteration. WRITE interest is only
+    // armed once the socket pushes back, so a request/response
+    // connection never changes its epoll registration.
+    if (size && !dirty_ && !error_ && !(tp_->ev_flags() & ev::WRITE)) {
+	dirty_ = true;
+	nn_loop::get_tls_loop()->defer_flush(this);
+    }
     return x;
 }
 
+template <typename T>
+void async_buffered_transport<T>::flush_deferred() {
+    dirty_ = false;
+    int the_errno = 0;
+    if (error_)
+	return;
+    if (!flush(&the_errno)) {
+	nn_loop::get_tls_loop()->count_event();
+	fail(the_errno);
+    }
+}
+
 template <typename T>
 async_buffered_transport<T>::async_buffered_transport(transport* tp, transport_handler<T>* ioh)
-    : in_(outbuf::make(1)), ioh_(ioh) {
+    : in_(NULL), ring_(NULL), mirrored_(mirrored_inbuf()), dirty_(false), error_(false),
+      throttled_(false), paused_(false), rejected_(0), out_bytes_(0), high_wm_(0), low_wm_(0),
+      zc_next_(0), zc_acked_(0), ioh_(ioh) {
+    // mirrored inbufs are expensive to set up, so they are kept for the
+    // lifetime of the connection
+    if (mirrored_)
+	in_ = inbuf::make(1, true);
     tp_ = tp;
     using std::placeholders::_1;
     using std::placeholders::_2;
@@ -131,38 +413,101 @@ async_buffered_transport<T>::async_buffered_transport(transport* tp, transport_h
 
 template <typename T>
 async_buffered_transport<T>::~async_buffered_transport() {
+    if (dirty_)
+	nn_loop::get_tls_loop()->cancel_flush(this);
     if (tp_) {
         tp_->eselect(0);
         delete tp_;
     }
-    outbuf::free(in_);
+    if (in_)
+	inbuf::free(in_);
+    if (ring_)
+	inbuf::free(ring_);
     while (!out_active_.empty()) {
 	outbuf* x = &(out_active_.front());
 	out_active_.pop_front();
 	outbuf::free(x);
     }
-    while (!out_free_.empty()) {
-	outbuf* x = &(out_free_.front());
-	out_free_.pop_front();
+    while (!zc_wait_.empty()) {
+	outbuf* x = &(zc_wait_.front());
+	zc_wait_.pop_front();
 	outbuf::free(x);
     }
 }
 
+template <typename T>
+void async_buffered_transport<T>::detach() {
+    // the deferred flush, if any, happens on the new loop
+    if (dirty_)
+	nn_loop::get_tls_loop()->cancel_flush(this);
+    detach_transport(tp_, std::integral_constant<bool, can_migrate<T>::value>());
+    move_buffers(false);
+}
+
+template <typename T>
+void async_buffered_transport<T>::attach() {
+    move_buffers(true);
+    using std::placeholders::_1;
+    using std::placeholders::_2;
+    tp_->register_callback(
+	    std::bind(&async_buffered_transport<T>::event_handler, this, _1, _2),
+	    ev::READ);
+    paused_ = false;
+    select(false);
+    if ((dirty_ = out_bytes_ != 0))
+	nn_loop::get_tls_loop()->defer_flush(this);
+}
+
+/** Our buffers are released to the pool of the loop we run on, so they
+    change pools along with the connection. */
+template <typename T>
+void async_buffered_transport<T>::move_buffers(bool adopt) {
+    buffer_pool& bp = nn_loop::get_tls_loop()->buffers();
+    auto move = [&bp, adopt](size_t n) {
+	if (adopt)
+	    bp.adopt(n);
+	else
+	    bp.disown(n);
+    };
+    if (in_ && in_->pooled())
+	move(in_->capacity + sizeof(inbuf));
+    if (ring_ && ring_->pooled())
+	move(ring_->capacity + sizeof(inbuf));
+    for (auto& x : out_active_)
+	move(x.capacity + sizeof(outbuf));
+    for (auto& x : zc_wait_)
+	move(x.capacity + sizeof(outbuf));
+}
+
 /** Postcondition: in_ has at least size bytes of space from head_ */
 template <typename T>
 void async_buffered_transport<T>::resize_inbuf(uint32_t size) {
     uint32_t h = in_->head;
-    if (h + size > in_->capacity && size < in_->capacity / 2) {
+    if (h + size > in_->end() && size >= large_frame()) {
+	// Large frame: only [h, tail) has arrived, and the rest is read
+	// straight into its final place. The buffer holds the frame and
+	// nothing else, so once it is consumed the buffer is empty and
+	// fill() drops it, bringing back the ring.
+	inbuf *x = inbuf::make_exact(size);
+	x->tail = in_->tail - h;
+	memcpy(x->buf, in_->buf + h, x->tail);
+	if (in_->mirrored) {
+	    ring_ = in_;
+	    ring_->head = ring_->tail = 0;
+	} else
+	    inbuf::free(in_);
+	in_ = x;
+    } else if (h + size > in_->end() && size < in_->capacity / 2 && !in_->mirrored) {
 	in_->tail -= h;
 	memmove(in_->buf, in_->buf + h, in_->tail);
 	in_->head = 0;
-    } else if (h + size > in_->capacity) {
+    } else if (h + size > in_->end()) {
 	if (size < in_->capacity * 2)
-	    size = in_->capacity * 2 + 16 + sizeof(outbuf);
-	outbuf *x = outbuf::make(size);
+	    size = in_->capacity * 2;
+	inbuf *x = inbuf::make(size, in_->mirrored);
 	x->tail = in_->tail - h;
 	memcpy(x->buf, in_->buf + h, x->tail);
-	outbuf::free(in_);
+	inbuf::free(in_);
 	in_ = x;
     }
 }
@@ -174,39 +519,44 @@ void async_buffered_transport<T>::refill_outbuf(uint32_t size) {
         outbuf& x = out_active_.back();
 	if (x.tail + size <= x.capacity)
 	    return;
-    }
-    auto prev = out_free_.begin();
-    for (auto it = out_free_.begin(); it != out_free_.end(); prev = it, ++it) {
-	if (it->tail + size <= it->capacity) {
-	    outbuf* x = it.operator->();
-	    if (it == out_free_.begin())
-		out_free_.pop_front();
-	    else
-	        out_free_.erase_after(prev);
-	    out_active_.push_back(*x);
-	    return;
-	}
+	// a connection that keeps writing gets bigger buffers
+	if (x.capacity + sizeof(outbuf) < size_t(buffer_grow_limit))
+	    size = std::max(size, x.capacity * 2);
     }
     outbuf* x = outbuf::make(size);
     mandatory_assert(x);
     out_active_.push_back(*x);
 }
 
+/** An idle connection holds no inbuf: one is taken from the loop's
+    buffer_pool on each readiness event and handed back once every
+    received byte has been parsed. */
 template <typename T>
 int async_buffered_transport<T>::fill(int* the_errno) {
-    if (in_->head == in_->tail)
+    if (!in_)
+	in_ = inbuf::make(1, false);
+    else if (in_->head == in_->tail)
 	in_->head = in_->tail = 0;
 
-    uint32_t old_tail = in_->tail;
-    while (in_->tail != in_->capacity) {
-	ssize_t r = tp_->read(in_->buf + in_->tail, in_->capacity - in_->tail);
+    // growing moves the data, so count reads rather than compare tails
+    bool got = false;
+    while (in_->tail != in_->end()) {
+	ssize_t r = tp_->read(in_->buf + in_->tail, in_->end() - in_->tail);
 	if (r != 0 && r != -1) {
 	    in_->tail += r;
-            break;
+	    got = true;
+	    // more is probably waiting: grow a small inbuf that filled up
+	    if (in_->tail == in_->end() && in_->growable()) {
+		resize_inbuf(in_->tail - in_->head + in_->capacity);
+		continue;
+	    }
+	    // the body of a large frame is read in one go
+	    if (in_->capacity < large_frame())
+		break;
         } else if (r == -1 && errno == EINTR)
 	    continue;
 	else if ((r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
-		 || (r == 0 && in_->tail != old_tail))
+		 || (r == 0 && got))
 	    break;
 	else {
 	    if (the_errno)
@@ -215,37 +565,81 @@ int async_buffered_transport<T>::fill(int* the_errno) {
 	}
     }
 
-    if (old_tail != in_->tail) {
-	int old_flags = tp_->ev_flags();
+    if (got)
 	ioh_->buffered_read(this, in_->buf + in_->head, in_->tail - in_->head);
-	// if flags have changed, we have something to write
-	return tp_->ev_flags() != old_flags ? 2 : 1;
-    } else
-	return 1;
+    if (rejected_) {
+	if (the_errno)
+	    *the_errno = rejected_;
+	return 0;
+    }
+    if (in_->head == in_->tail && (ring_ || !in_->mirrored)) {
+	inbuf::free(in_);
+	in_ = ring_;
+	ring_ = NULL;
+    }
+    return 1;
 }
 
+/** Hand all active outbufs (at most IOV_MAX of them) to the kernel
+    in one writev. A partial write may end in the middle of any buffer. */
 template <typename T>
 int async_buffered_transport<T>::flush(int* the_errno) {
+    struct iovec iov[IOV_MAX];
+    uint32_t zc = transport_zerocopy_threshold(tp_, zerocopy_type());
+    if (zc_next_ != zc_acked_)
+	reap_zerocopy();
     while (1) {
 	if (out_active_.empty()) {
-	    tp_->eselect(ev::READ);
+	    select(false);
 	    return 1;
 	}
-	outbuf* x = &(out_active_.front());
-	mandatory_assert(x->tail != x->head && x->tail);
+	int n = 0;
+	bool zerocopy = false;
+	for (auto it = out_active_.begin();
+	     it != out_active_.end() && n < IOV_MAX; ++it, ++n) {
+	    mandatory_assert(it->tail != it->head && it->tail);
+	    iov[n].iov_base = it->buf + it->head;
+	    iov[n].iov_len = it->tail - it->head;
+	    if (zc && iov[n].iov_len >= zc)
+		zerocopy = true;
+	}
 
-	ssize_t w = tp_->write(x->buf + x->head, x->tail - x->head);
+	ssize_t w;
+	if (zerocopy) {
+	    w = transport_writev_zerocopy(tp_, iov, n, zerocopy_type());
+	    if (w == -1 && errno == ENOBUFS) {
+		// out of option memory for notifications; copy instead
+		zerocopy = false;
+		w = tp_->writev(iov, n);
+	    }
+	} else
+	    w = tp_->writev(iov, n);
 	if (w != 0 && w != -1) {
-	    x->head += w;
-	    if (x->head == x->tail) {
-		x->head = x->tail = 0;
+	    uint32_t id = zerocopy ? zc_next_++ : 0;
+	    out_bytes_ -= w;
+	    if (throttled_ && out_bytes_ <= low_wm_)
+		throttle(false);
+	    while (w) {
+		outbuf* x = &(out_active_.front());
+		if (zerocopy) {
+		    x->zc = true;
+		    x->zc_id = id;
+		}
+		if (size_t(w) < x->tail - x->head) {
+		    x->head += w;
+		    break;
+		}
+		w -= x->tail - x->head;
 	        out_active_.pop_front();
-		out_free_.push_front(*x);
+		if (x->zc)
+		    zc_wait_.push_back(*x);
+		else
+		    outbuf::free(x);
 	    }
 	} else if (w == -1 && errno == EINTR)
 	    /* do nothing */;
 	else if (w == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-	    tp_->eselect(ev::READ | ev::WRITE);
+	    select(true);
 	    return 1;
 	} else {
 	    if (the_errno)
@@ -255,4 +649,32 @@ int async_buffered_transport<T>::flush(int* the_errno) {
     }
 }
 
+/** Collect zero-copy completions and release the outbufs the kernel
+    no longer references. */
+template <typename T>
+void async_buffered_transport<T>::reap_zerocopy() {
+    uint32_t lo, hi;
+    while (transport_reap_zerocopy(tp_, lo, hi, zerocopy_type())) {
+	if (int32_t(lo - zc_acked_) > 0) {
+	    zc_early_.push_back(std::make_pair(lo, hi));
+	    continue;
+	}
+	if (int32_t(hi + 1 - zc_acked_) > 0)
+	    zc_acked_ = hi + 1;
+	for (size_t i = 0; i < zc_early_.size(); )
+	    if (int32_t(zc_early_[i].first - zc_acked_) <= 0) {
+		if (int32_t(zc_early_[i].second + 1 - zc_acked_) > 0)
+		    zc_acked_ = zc_early_[i].second + 1;
+		zc_early_.erase(zc_early_.begin() + i);
+		i = 0;
+	    } else
+		++i;
+    }
+    while (!zc_wait_.empty() && int32_t(zc_wait_.front().zc_id - zc_acked_) < 0) {
+	outbuf* x = &(zc_wait_.front());
+	zc_wait_.pop_front();
+	outbuf::free(x);
+    }
+}
+
 } // namespace rpc
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace rpc {
+
+/** @brief Buffer memory shared by all transports of one nn_loop.
+    Blocks come in power-of-two size classes from 4KB to 1MB and are
+    kept on per-class free lists; larger blocks go straight to malloc.
+    Not thread safe: only the thread owning the loop may use it. */
+struct buffer_pool {
+    enum { min_shift = 12, nclass = 9 };
+    // free blocks kept per class before memory goes back to malloc
+    enum { max_free_bytes = 16 << 20, min_free_blocks = 4 };
+
+    buffer_pool() : nlarge_(0), large_bytes_(0) {
+	bzero(free_, sizeof(free_));
+	bzero(nfree_, sizeof(nfree_));
+	bzero(nused_, sizeof(nused_));
+    }
+    ~buffer_pool() {
+	for (int c = 0; c < nclass; ++c)
+	    while (void* x = free_[c]) {
+		free_[c] = *reinterpret_cast<void**>(x);
+		::free(x);
+	    }
+    }
+
+    /** Returns a block of at least @a size bytes, and sets @a size to
+	the usable size of the block. */
+    void* alloc(size_t& size) {
+	int c = size_class(size);
+	if (c < 0) {
+	    ++nlarge_;
+	    large_bytes_ += size;
+	    return malloc(size);
+	}
+	size = class_size(c);
+	++nused_[c];
+	if (void* x = free_[c]) {
+	    free_[c] = *reinterpret_cast<void**>(x);
+	    --nfree_[c];
+	    return x;
+	}
+	return malloc(size);
+    }
+    /** @a size must be the size alloc() returned for @a x */
+    void release(void* x, size_t size) {
+	int c = size_class(size);
+	if (c < 0) {
+	    --nlarge_;
+	    large_bytes_ -= size;
+	    ::free(x);
+	    return;
+	}
+	--nused_[c];
+	if (nfree_[c] >= min_free_blocks
+	    && (nfree_[c] + 1) * class_size(c) > size_t(max_free_bytes))
+	    ::free(x);
+	else {
+	    *reinterpret_cast<void**>(x) = free_[c];
+	    free_[c] = x;
+	    ++nfree_[c];
+	}
+    }
+    // A block of @a size moves to another pool (see
+    // async_buffered_transport::detach), which releases it there.
+    void disown(size_t size) {
+	int c = size_class(size);
+	if (c < 0) {
+	    --nlarge_;
+	    large_bytes_ -= size;
+	} else
+	    --nused_[c];
+    }
+    void adopt(size_t size) {
+	int c = size_class(size);
+	if (c < 0) {
+	    ++nlarge_;
+	    large_bytes_ += size;
+	} else
+	    ++nused_[c];
+    }
+
+    static size_t class_size(int c) {
+	return size_t(1) << (c + min_shift);
+    }
+    // blocks handed out / cached in class c
+    uint64_t nused(int c) const {
+	return nused_[c];
+    }
+    uint64_t nfree(int c) const {
+	return nfree_[c];
+    }
+    uint64_t used_bytes() const {
+	uint64_t n = large_bytes_;
+	for (int c = 0; c < nclass; ++c)
+	    n += nused_[c] * class_size(c);
+	return n;
+    }
+    uint64_t free_bytes() const {
+	uint64_t n = 0;
+	for (int c = 0; c < nclass; ++c)
+	    n += nfree_[c] * class_size(c);
+	return n;
+    }
+    void print(FILE* fp) const {
+	fprintf(fp, "%10s %10s %10s\n", "class", "used", "free");
+	for (int c = 0; c < nclass; ++c)
+	    if (nused_[c] || nfree_[c])
+		fprintf(fp, "%10zu %10lu %10lu\n", class_size(c),
+			(unsigned long) nused_[c], (unsigned long) nfree_[c]);
+	if (nlarge_)
+	    fprintf(fp, "%10s %10lu %10s (%lu bytes)\n", "large",
+		    (unsigned long) nlarge_, "-", (unsigned long) large_bytes_);
+    }
+
+  private:
+    void* free_[nclass];
+    uint64_t nfree_[nclass];
+    uint64_t nused_[nclass];
+    uint64_t nlarge_;
+    uint64_t large_bytes_;
+
+    static int size_class(size_t size) {
+	for (int c = 0; c < nclass; ++c)
+	    if (size <= class_size(c))
+		return c;
+	return -1;
+    }
+};
+
+/** @brief Small objects of one nn_loop, such as client requests: kept on
+    free lists per 16-byte size class up to max_size, so that objects of
+    one type share a list. Larger ones go straight to malloc. Not
+    thread safe, like buffer_pool. */
+struct object_pool {
+    enum { grain = 16, max_size = 1024, nclass = max_size / grain };
+    // free objects kept per class before memory goes back to malloc
+    enum { max_free = 4096 };
+
+    object_pool() {
+	bzero(free_, sizeof(free_));
+	bzero(nfree_, sizeof(nfree_));
+    }
+    ~object_pool() {
+	for (int c = 0; c < nclass; ++c)
+	    while (void* x = free_[c]) {
+		free_[c] = *reinterpret_cast<void**>(x);
+		::free(x);
+	    }
+    }
+    void* alloc(size_t size) {
+	if (size > max_size)
+	    return malloc(size);
+	int c = (size - 1) / grain;
+	if (void* x = free_[c]) {
+	    free_[c] = *reinterpret_cast<void**>(x);
+	    --nfree_[c];
+	    return x;
+	}
+	return malloc((c + 1) * grain);
+    }
+    /** @a x may come from the pool of another loop */
+    void release(void* x, size_t size) {
+	int c = (size - 1) / grain;
+	if (size > max_size || nfree_[c] >= max_free)
+	    ::free(x);
+	else {
+	    *reinterpret_cast<void**>(x) = free_[c];
+	    free_[c] = x;
+	    ++nfree_[c];
+	}
+    }
+
+  private:
+    void* free_[nclass];
+    uint32_t nfree_[nclass];
+};
+
+}
@@ -0,0 +1,359 @@
+#pragma once
+#include <sys/uio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include <random>
+#include <functional>
+#include <algorithm>
+#include <type_traits>
+#include <ev++.h>
+
+#include "rpc/libev_loop.hh"
+#include "rpc/tcp_provider.hh"
+#include "rpc_common/compiler.hh"
+#include "rpc_common/util.hh"
+
+// Network emulation for benchmarks: emunet<T> wraps the async
+// transports of provider T (tcpnet, unixnet, ...) and holds the bytes
+// going each way in a timed queue, driven by an nn_loop timer, before
+// passing them on. Synchronous transports are not emulated.
+//
+// Each side shapes what it sends (outgoing()) and what it receives
+// (incoming()). When client and server share a process, shaping only
+// the outgoing direction applies every setting once per message.
+
+namespace rpc {
+
+struct emu_params {
+    emu_params()
+	: delay(0), jitter(0), bandwidth(0), stall_every(0), stall_for(0),
+	  loss(0), rto(200000), max_queued(4 << 20), seed(1) {
+    }
+    uint64_t delay;       // microseconds added to every chunk
+    uint64_t jitter;      // up to this many more microseconds, uniformly
+    uint64_t bandwidth;   // bytes per second; 0 is unlimited
+    uint64_t stall_every; // mean microseconds between stalls; 0 is none
+    uint64_t stall_for;   // microseconds a stall lasts
+    double loss;          // probability that a chunk is retransmitted,
+    uint64_t rto;         // which delays it by rto microseconds
+    size_t max_queued;    // bytes held before pushing back
+    uint64_t seed;        // connections are seeded in creation order
+};
+
+// one direction of an emulated connection
+struct emu_link {
+    emu_link(const emu_params& p, uint64_t seed)
+	: p_(p), rng_(seed), free_at_(0), last_(0), stall_at_(0), bytes_(0) {
+    }
+    struct chunk {
+	std::string data;
+	size_t off;
+	uint64_t at;
+    };
+    // queue @a len bytes from @a p that enter the link at @a now
+    void push(const char* p, size_t len, uint64_t now) {
+	chunk c;
+	c.data.assign(p, len);
+	c.off = 0;
+	c.at = release_time(len, now);
+	q_.push_back(std::move(c));
+	bytes_ += len;
+    }
+    bool ready(uint64_t now) const {
+	return !q_.empty() && q_.front().at <= now;
+    }
+    // next release, or 0 if the link is empty
+    uint64_t next() const {
+	return q_.empty() ? 0 : q_.front().at;
+    }
+    bool full() const {
+	return bytes_ >= p_.max_queued;
+    }
+    bool empty() const {
+	return q_.empty();
+    }
+    chunk& front() {
+	return q_.front();
+    }
+    void consume(size_t n) {
+	chunk& c = q_.front();
+	c.off += n;
+	bytes_ -= n;
+	if (c.off == c.data.size())
+	    q_.pop_front();
+    }
+  private:
+    uint64_t release_time(size_t len, uint64_t now) {
+	uint64_t t = std::max(now, free_at_);
+	if (p_.bandwidth)
+	    t += len * 1000000 / p_.bandwidth;
+	free_at_ = t;
+	t += p_.delay;
+	if (p_.jitter)
+	    t += std::uniform_int_distribution<uint64_t>(0, p_.jitter)(rng_);
+	if (p_.loss > 0 && std::bernoulli_distribution(p_.loss)(rng_))
+	    t += p_.rto;
+	if (p_.stall_every && p_.stall_for) {
+	    if (!stall_at_)
+		stall_at_ = now + next_stall();
+	    while (t >= stall_at_) {
+		uint64_t end = stall_at_ + p_.stall_for;
+		if (t < end)
+		    t = end;
+		stall_at_ = end + next_stall();
+	    }
+	}
+	// bytes of a stream leave in order
+	last_ = t = std::max(t, last_);
+	return t;
+    }
+    uint64_t next_stall() {
+	return std::exponential_distribution<double>(1.0 / p_.stall_every)(rng_);
+    }
+
+    emu_params p_;
+    std::mt19937_64 rng_;
+    uint64_t free_at_;  // when the previous chunk is fully serialized
+    uint64_t last_;
+    uint64_t stall_at_;
+    size_t bytes_;
+    std::deque<chunk> q_;
+};
+
+template <typename T>
+struct emunet;
+
+template <typename T>
+struct emu_transport {
+    typedef typename T::async_transport child_transport;
+    typedef std::function<bool(emu_transport<T>*, int)> event_handler_type;
+
+    ~emu_transport() {
+	timer_.stop();
+	tp_->eselect(0);
+	delete tp_;
+    }
+    ssize_t read(void* buffer, size_t len) {
+	uint64_t now = rpc::common::tstamp();
+	size_t n = 0;
+	while (n < len && in_.ready(now)) {
+	    emu_link::chunk& c = in_.front();
+	    size_t k = std::min(len - n, c.data.size() - c.off);
+	    memcpy((char*) buffer + n, &c.data[c.off], k);
+	    in_.consume(k);
+	    n += k;
+	}
+	if (n) {
+	    update();
+	    return n;
+	}
+	if (out_errno_) {
+	    errno = out_errno_;
+	    return -1;
+	}
+	if (in_.empty() && in_errno_ >= 0) {
+	    errno = in_errno_;
+	    return in_errno_ ? -1 : 0;
+	}
+	errno = EAGAIN;
+	return -1;
+    }
+    ssize_t write(const void* buffer, size_t len) {
+	struct iovec iov = {const_cast<void*>(buffer), len};
+	return writev(&iov, 1);
+    }
+    ssize_t writev(const struct iovec* iov, int iovcnt) {
+	if (out_errno_) {
+	    errno = out_errno_;
+	    return -1;
+	}
+	if (out_.full()) {
+	    errno = EAGAIN;
+	    return -1;
+	}
+	std::string s;
+	for (int i = 0; i < iovcnt; ++i)
+	    s.append((const char*) iov[i].iov_base, iov[i].iov_len);
+	out_.push(s.data(), s.size(), rpc::common::tstamp());
+	update();
+	return s.size();
+    }
+    // after the queued bytes are out
+    void shutdown() {
+	shutdown_ = true;
+	if (out_.empty())
+	    tp_->shutdown();
+    }
+    void register_callback(event_handler_type cb, int flags) {
+	cb_ = cb;
+	timer_.set(nn_loop::get_tls_loop()->ev_loop());
+	timer_.set<emu_transport<T>, &emu_transport<T>::fire>(this);
+	using std::placeholders::_1;
+	using std::placeholders::_2;
+	tp_->register_callback(
+		std::bind(&emu_transport<T>::child_event, this, _1, _2), ev::READ);
+	eselect(flags);
+    }
+    void eselect(int flags) {
+	flags_ = flags;
+	update();
+    }
+    // see can_migrate
+    void detach() {
+	timer_.stop();
+	tp_->detach();
+    }
+    // see has_request_state
+    void drop(uint32_t seq) {
+	tp_->drop(seq);
+    }
+    int ev_flags() const {
+	return flags_;
+    }
+
+  protected:
+    friend struct emunet<T>;
+    emu_transport(child_transport* tp, uint64_t seed)
+	: tp_(tp), flags_(0), in_errno_(-1), out_errno_(0), shutdown_(false),
+	  out_(emunet<T>::outgoing(), seed), in_(emunet<T>::incoming(), seed + 1) {
+    }
+
+  private:
+    // events we owe the owner right now
+    int pending(uint64_t now) const {
+	int e = 0;
+	if (in_.ready(now) || (in_.empty() && in_errno_ >= 0) || out_errno_)
+	    e |= ev::READ;
+	if (!out_.full())
+	    e |= ev::WRITE;
+	return e & flags_;
+    }
+    // select on the child and arm the timer
+    void update() {
+	int cf = 0;
+	if (!in_.full() && in_errno_ < 0)
+	    cf |= ev::READ;
+	uint64_t now = rpc::common::tstamp();
+	if (out_.ready(now) && !out_errno_)
+	    cf |= ev::WRITE;
+	tp_->eselect(cf);
+	uint64_t at = 0;
+	if (pending(now))
+	    at = now;
+	else {
+	    if (flags_ & ev::READ)
+		at = in_.next();
+	    if (out_.next() > now && (!at || out_.next() < at))
+		at = out_.next();
+	}
+	timer_.stop();
+	if (at)
+	    timer_.start(at > now ? (at - now) / 1000000.0 : 0.);
+    }
+    void pump(uint64_t now) {
+	while (out_.ready(now) && !out_errno_) {
+	    emu_link::chunk& c = out_.front();
+	    ssize_t w = tp_->write(&c.data[c.off], c.data.size() - c.off);
+	    if (w > 0)
+		out_.consume(w);
+	    else if (w == -1 && errno == EINTR)
+		continue;
+	    else if (w == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		break;
+	    else
+		out_errno_ = w == -1 ? errno : EPIPE;
+	}
+	if (shutdown_ && out_.empty())
+	    tp_->shutdown();
+    }
+    // true if the owner deleted us
+    bool dispatch() {
+	uint64_t now = rpc::common::tstamp();
+	pump(now);
+	int e = pending(now);
+	if (e && cb_(this, e))
+	    return true;
+	update();
+	return false;
+    }
+    bool child_event(child_transport*, int e) {
+	if (e & ev::READ) {
+	    char buf[65536];
+	    while (!in_.full()) {
+		ssize_t r = tp_->read(buf, sizeof(buf));
+		if (r > 0)
+		    in_.push(buf, r, rpc::common::tstamp());
+		else if (r == -1 && errno == EINTR)
+		    continue;
+		else {
+		    if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			in_errno_ = r == 0 ? 0 : errno;
+		    break;
+		}
+	    }
+	}
+	return dispatch();
+    }
+    void fire(ev::timer&, int) {
+	dispatch();
+    }
+
+    child_transport* tp_;
+    int flags_;
+    int in_errno_;  // 0 for EOF once the child reports it
+    int out_errno_;
+    bool shutdown_;
+    emu_link out_;
+    emu_link in_;
+    event_handler_type cb_;
+    ev::timer timer_;
+};
+
+template <typename T>
+struct emunet {
+    typedef typename T::sync_transport sync_transport;
+    typedef emu_transport<T> async_transport;
+    static const bool async_connect = has_async_connect<T>::value;
+    static const bool migratable = can_migrate<T>::value;
+    static const bool handshake = has_handshake<T>::value;
+    static const bool request_state = has_request_state<T>::value;
+
+    template <typename U>
+    static typename std::enable_if<std::is_same<U, async_transport>::value, U*>::type
+    make(int fd) {
+	typedef typename T::async_transport child_transport;
+	child_transport* tp = T::template make<child_transport>(fd);
+	if (!tp)
+	    return NULL;
+	static uint64_t nconn = 0;
+	return new async_transport(tp, outgoing().seed + 2 * nconn++);
+    }
+    template <typename U>
+    static typename std::enable_if<!std::is_same<U, async_transport>::value, U*>::type
+    make(int fd) {
+	return T::template make<U>(fd);
+    }
+    static sync_transport* make_sync(int fd) {
+	return T::make_sync(fd);
+    }
+    static async_transport* make_async(int fd) {
+	return make<async_transport>(fd);
+    }
+    static void set_poll_interval(int us) {
+	T::set_poll_interval(us);
+    }
+    // settings for connections created from now on
+    static emu_params& outgoing() {
+	static emu_params p;
+	return p;
+    }
+    static emu_params& incoming() {
+	static emu_params p;
+	return p;
+    }
+};
+
+}
@@ -2,19 +2,175 @@
 
 #include "rpc_common/util.hh"
 #include "rpc_parser.hh"
+#include "timer_wheel.hh"
 #include <type_traits>
+#include <vector>
+#include <stdlib.h>
+#include <new>
 
 namespace rpc {
 
-struct gcrequest_base {
+struct gcrequest_base;
+
+// what a call waits on, see gcrequest_base::set_deadline
+struct call_owner {
+    virtual void call_expired(gcrequest_base* q) = 0;
+};
+
+struct gcrequest_base : public wheel_timer {
+    gcrequest_base(uint32_t proc)
+	: owner_(NULL), proc_(proc), tstart_(rpc::common::tstamp()), deadline_(0) {
+    }
+    // Each completes the call, which is gone afterwards
     virtual void process_reply(parser& p) = 0;
     virtual void process_connection_error() = 0;
-    virtual uint32_t proc() const = 0;
-    virtual uint64_t start_at() const = 0;
+    // the deadline passed
+    virtual void process_timeout() = 0;
+    // the caller gave up, see async_rpcc::cancel
+    virtual void process_cancel() = 0;
+    // the request, to send it again
+    virtual uint32_t request_size() = 0;
+    virtual void serialize_request(uint8_t* x, uint32_t size) = 0;
     virtual ~gcrequest_base() {
     }
+    uint32_t proc() const {
+	return proc_;
+    }
+    uint64_t start_at() const {
+	return tstart_;
+    }
+    // Complete the call with process_timeout at @a at, a
+    // rpc::common::tstamp(), if no reply came by then; this overrides
+    // the connection's timeout for the PROC. Before the call is made.
+    void set_deadline(uint64_t at) {
+	deadline_ = at;
+    }
+    void set_timeout(double seconds) {
+	deadline_ = tstart_ + uint64_t(seconds * 1000000);
+    }
+    // 0 if none
+    uint64_t deadline() const {
+	return deadline_;
+    }
+    void expire() {
+	owner_->call_expired(this);
+    }
     uint32_t seq_;
+    call_owner* owner_;  // while the deadline is scheduled
     static uint32_t last_server_latency_;
+  private:
+    uint32_t proc_;
+    uint64_t tstart_;
+    uint64_t deadline_;
+};
+
+/** Names a call made with async_rpcc, to cancel it. It goes stale,
+    harmlessly, once the call completes. */
+struct call_handle {
+    call_handle() : owner_(NULL), seq_(0) {
+    }
+    call_handle(call_owner* owner, uint32_t seq) : owner_(owner), seq_(seq) {
+    }
+    // false if the call cannot be cancelled (e.g. it was local, or
+    // completed at once)
+    bool valid() const {
+	return owner_ != NULL;
+    }
+    call_owner* owner_;
+    uint32_t seq_;
+};
+
+/** Calls waiting for their reply. The low slot_bits of a sequence
+    number index the call's slot and the rest is the slot's generation,
+    bumped on each use: lookup and insert are O(1) without hashing, and
+    the reply of a call that is gone no longer matches its slot. Free
+    slots are reused last in, first out, so the hot ones stay in cache,
+    and the table shrinks back once no call is waiting. */
+struct waiting_table {
+    enum { slot_bits = 16, max_slots = 1 << slot_bits,
+	   min_slots = 16, shrink_at = 64 };
+
+    waiting_table() : free_(none), n_(0) {
+    }
+    // Sets @a seq; false if max_slots calls are already waiting.
+    bool insert(gcrequest_base* q, uint32_t& seq) {
+	if (free_ == none) {
+	    if (slots_.size() == max_slots)
+		return false;
+	    grow();
+	}
+	slot& s = slots_[free_];
+	free_ = s.next;
+	s.seq += 1 << slot_bits;
+	s.q = q;
+	++n_;
+	seq = s.seq;
+	return true;
+    }
+    // The call waiting for @a seq, which leaves the table; NULL if
+    // there is none (a stale or bogus reply). Given @a proc, the call
+    // must be to it too: a slot's generation wraps after 65536 calls,
+    // so a reply that late could match the call now in the slot.
+    gcrequest_base* remove(uint32_t seq, uint32_t proc = none) {
+	uint32_t i = seq & (max_slots - 1);
+	if (i >= slots_.size() || !slots_[i].q || slots_[i].seq != seq
+	    || (proc != none && slots_[i].q->proc() != proc))
+	    return NULL;
+	gcrequest_base* q = slots_[i].q;
+	release(i);
+	return q;
+    }
+    template <typename F>
+    void for_each(F f) {
+	for (auto& s : slots_)
+	    if (s.q)
+		f(s.q);
+    }
+    // Remove every call, applying @a f to each.
+    template <typename F>
+    void clear(F f) {
+	for (uint32_t i = 0; i < slots_.size() && n_; ++i)
+	    if (gcrequest_base* q = slots_[i].q) {
+		release(i);
+		f(q);
+	    }
+    }
+    size_t size() const {
+	return n_;
+    }
+    size_t capacity() const {
+	return slots_.size();
+    }
+
+  private:
+    enum { none = uint32_t(-1) };
+    struct slot {
+	gcrequest_base* q;
+	uint32_t seq;
+	uint32_t next;  // free list
+    };
+    std::vector<slot> slots_;
+    uint32_t free_;
+    uint32_t n_;
+
+    void grow() {
+	// generations start at random, as sequence numbers used to
+	slot s = {NULL, uint32_t(random()) << slot_bits | uint32_t(slots_.size()), none};
+	slots_.push_back(s);
+	free_ = slots_.size() - 1;
+    }
+    void release(uint32_t i) {
+	slots_[i].q = NULL;
+	slots_[i].next = free_;
+	free_ = i;
+	if (--n_ == 0 && slots_.size() > shrink_at) {
+	    slots_.resize(min_slots);
+	    slots_.shrink_to_fit();
+	    for (uint32_t j = 0; j < min_slots; ++j)
+		slots_[j].next = j + 1 < min_slots ? j + 1 : none;
+	    free_ = 0;
+	}
+    }
 };
 
 template <typename T>
@@ -35,36 +191,121 @@ template <typename T>
 typename std::enable_if<!has_eno<T>::value, void>::type set_default_eno(T* r) {
 }
 
+// Whether the application's ErrorCode has TIMEOUT; RPCERR is used if not
+template <typename E>
+struct has_timeout_code {
+    template <typename C>
+    static uint8_t test(decltype(C::TIMEOUT)*);
+    template <typename>
+    static uint32_t test(...);
+    static const bool value = (sizeof(test<E>(0)) == 1);
+};
+
+template <typename E>
+typename std::enable_if<has_timeout_code<E>::value, E>::type timeout_code() {
+    return E::TIMEOUT;
+}
+
+template <typename E>
+typename std::enable_if<!has_timeout_code<E>::value, E>::type timeout_code() {
+    return E::RPCERR;
+}
+
+template <typename T>
+typename std::enable_if<has_eno<T>::value, void>::type set_timeout_eno(T* r) {
+    r->set_eno(timeout_code<app_param::ErrorCode>());
+}
+
+template <typename T>
+typename std::enable_if<!has_eno<T>::value, void>::type set_timeout_eno(T* r) {
+}
+
+// Whether the application's ErrorCode has CANCELLED; RPCERR is used if not
+template <typename E>
+struct has_cancelled_code {
+    template <typename C>
+    static uint8_t test(decltype(C::CANCELLED)*);
+    template <typename>
+    static uint32_t test(...);
+    static const bool value = (sizeof(test<E>(0)) == 1);
+};
+
+template <typename E>
+typename std::enable_if<has_cancelled_code<E>::value, E>::type cancelled_code() {
+    return E::CANCELLED;
+}
+
+template <typename E>
+typename std::enable_if<!has_cancelled_code<E>::value, E>::type cancelled_code() {
+    return E::RPCERR;
+}
+
+template <typename T>
+typename std::enable_if<has_eno<T>::value, void>::type set_cancelled_eno(T* r) {
+    r->set_eno(cancelled_code<app_param::ErrorCode>());
+}
+
+template <typename T>
+typename std::enable_if<!has_eno<T>::value, void>::type set_cancelled_eno(T* r) {
+}
+
+// a client request for PROC, whichever way it completes; what
+// async_rpcc::call takes
 template <uint32_t PROC>
-struct gcrequest_iface : public gcrequest_base {
+struct gcrequest_typed : public gcrequest_base {
     typedef typename analyze_grequest<PROC, false>::request_type request_type;
     typedef typename analyze_grequest<PROC, false>::reply_type reply_type;
     typedef std::function<void(request_type&, reply_type&)> callback_type;
 
-    gcrequest_iface(callback_type cb): cb_(cb), tstart_(rpc::common::tstamp()) {
+    gcrequest_typed() : gcrequest_base(PROC) {
+    }
+    // reply_ was filled in by a service in this process
+    virtual void process_local_reply() = 0;
+    uint32_t request_size() {
+	return req().ByteSize();
+    }
+    void serialize_request(uint8_t* x, uint32_t size) {
+	req().SerializeToArray(x, size);
+    }
+    virtual request_type& req() = 0;
+    reply_type reply_;
+};
+
+// client request that completes through a std::function. Subclasses
+// provide req().
+template <uint32_t PROC>
+struct gcrequest_iface : public gcrequest_typed<PROC> {
+    typedef typename gcrequest_typed<PROC>::callback_type callback_type;
+
+    gcrequest_iface(callback_type cb) : cb_(cb) {
     }
     void process_reply(parser& p) {
-	p.parse_message(reply_);
-	cb_.operator()(req(), reply_);
+	p.parse_message(this->reply_);
+	cb_.operator()(this->req(), this->reply_);
+        delete this;
+    }
+    void process_local_reply() {
+	cb_.operator()(this->req(), this->reply_);
         delete this;
     }
     void process_connection_error() {
         //reply_.set_eno(app_param::ErrorCode::RPCERR);
-        set_default_eno(&reply_);
-	cb_.operator()(req(), reply_);
+        set_default_eno(&this->reply_);
+	cb_.operator()(this->req(), this->reply_);
         delete this;
     }
-    uint32_t proc() const {
-	return PROC;
+    void process_timeout() {
+        set_timeout_eno(&this->reply_);
+	cb_.operator()(this->req(), this->reply_);
+        delete this;
     }
-    uint64_t start_at() const {
-	return tstart_;
+    void process_cancel() {
+        set_cancelled_eno(&this->reply_);
+	cb_.operator()(this->req(), this->reply_);
+        delete this;
     }
-    virtual request_type& req() = 0;
-    reply_type reply_;
   private:
     callback_type cb_;
-    uint64_t tstart_;
 };
 
 // client request with inline storage for request
@@ -99,5 +340,58 @@ struct gcrequest_external : public gcrequest_iface<PROC> {
     request_type* req_;
 };
 
+/** Client request whose callback F is part of its type: completing it
+    costs one virtual call, and no std::function is involved. It lives
+    in the object_pool of the loop it is made on; make it with
+    make_gcrequest<PROC>(f) and never delete it. */
+template <uint32_t PROC, typename F>
+struct gcrequest_pooled : public gcrequest_typed<PROC> {
+    typedef gcrequest_pooled<PROC, F> self;
+    typedef typename gcrequest_typed<PROC>::request_type request_type;
+
+    static self* make(const F& f) {
+	return new (nn_loop::get_tls_loop()->objects().alloc(sizeof(self))) self(f);
+    }
+    void process_reply(parser& p) {
+	p.parse_message(this->reply_);
+	complete();
+    }
+    void process_local_reply() {
+	complete();
+    }
+    void process_connection_error() {
+        set_default_eno(&this->reply_);
+	complete();
+    }
+    void process_timeout() {
+        set_timeout_eno(&this->reply_);
+	complete();
+    }
+    void process_cancel() {
+        set_cancelled_eno(&this->reply_);
+	complete();
+    }
+    request_type& req() {
+	return req_;
+    }
+    request_type req_;
+  private:
+    F f_;
+
+    gcrequest_pooled(const F& f) : f_(f) {
+    }
+    void complete() {
+	f_(req_, this->reply_);
+	// the pool of the loop we complete on takes it
+	this->~self();
+	nn_loop::get_tls_loop()->objects().release(this, sizeof(self));
+    }
+};
+
+template <uint32_t PROC, typename F>
+inline gcrequest_pooled<PROC, F>* make_gcrequest(const F& f) {
+    return gcrequest_pooled<PROC, F>::make(f);
+}
+
 };
 
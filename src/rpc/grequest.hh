@@ -1,16 +1,38 @@
 #pragma once
 
+#include "rpc_common/util.hh"
+
 namespace rpc {
 
 struct grequest_base {
-    inline grequest_base(int proc) : proc_(proc) {
+    inline grequest_base(int proc) : proc_(proc), deadline_(0) {
     }
     inline int proc() const {
         return proc_;
     }
     virtual void execute() = 0;
+    // When the caller gives up, a rpc::common::tstamp(); 0 if never. Pass
+    // it on to the calls made on the caller's behalf (see
+    // gcrequest_base::set_deadline).
+    inline uint64_t deadline() const {
+        return deadline_;
+    }
+    inline void set_deadline(uint64_t at) {
+        deadline_ = at;
+    }
+    // microseconds left before the deadline, 0 if it passed
+    inline uint64_t remaining() const {
+        uint64_t now = rpc::common::tstamp();
+        return deadline_ > now ? deadline_ - now : 0;
+    }
+    // The caller cancelled the call (see async_rpcc::cancel). Execute the
+    // request anyway; no reply is sent.
+    virtual bool cancelled() const {
+        return false;
+    }
   private:
     int proc_;
+    uint64_t deadline_;
 };
 
 template <uint32_t PROC, bool NB = false>
@@ -33,8 +55,9 @@ struct grequest : public grequest_base {
 
 template <uint32_t PROC, bool NB, typename T>
 struct grequest_remote : public grequest<PROC, NB> {
-    inline grequest_remote(uint32_t seq, T* c) 
+    inline grequest_remote(uint32_t seq, T* c, uint64_t deadline = 0)
         : c_(c), seq_(seq) {
+        this->set_deadline(deadline);
     }
     inline uint32_t seq() const {
         return seq_;
@@ -47,6 +70,9 @@ struct grequest_remote : public grequest<PROC, NB> {
         if (!NB)
             delete this;
     }
+    bool cancelled() const {
+        return c_->cancelled(seq_);
+    }
     T* rpcc() {
         return c_;
     }
@@ -67,6 +93,21 @@ struct grequest_local : public grequest<PROC, NB>, public F {
     }
 };
 
+// a blocking request handed to the non-blocking version of a method:
+// the request is copied in and the reply copied back on execute.
+template <uint32_t PROC>
+struct grequest_nb_toggled : public grequest<PROC, true> {
+    inline grequest_nb_toggled(grequest<PROC, false>* q) : q_(q) {
+        this->req_.assign_nb_toggled(&q->req_);
+    }
+    inline void execute() {
+        q_->reply_.assign_nb_toggled(&this->reply_);
+        q_->execute();
+    }
+  private:
+    grequest<PROC, false>* q_;
+};
+
 template <uint32_t PROC>
 struct req_maker {
     template <typename F>
@@ -10,6 +10,7 @@
 #include <errno.h>
 #include <algorithm>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <queue>
 #include <thread>
 #include <stdarg.h>
@@ -367,6 +368,20 @@ struct infb_conn {
 	
 	return r;
     }
+    // there is no gather send on the queue pair; emulate writev
+    // by writing buffers in order until one is written partially.
+    ssize_t writev(const struct iovec* iov, int iovcnt) {
+	ssize_t r = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+	    ssize_t n = write(iov[i].iov_base, iov[i].iov_len);
+	    if (n < 0)
+		return r ? r : -1;
+	    r += n;
+	    if (size_t(n) != iov[i].iov_len)
+		break;
+	}
+	return r;
+    }
     ssize_t non_blocking_write_once(const void* buf, size_t len) {
 	if (len <= max_inline_size_) {
 	    if (post_send_with_buffer((const char*)buf, len, IBV_SEND_SIGNALED | IBV_SEND_INLINE) == 0)
@@ -841,6 +856,8 @@ struct ibnet {
     typedef infb_int_conn sync_transport;
 #endif
     typedef infb_async_conn async_transport;
+    // see has_handshake
+    static const bool handshake = true;
     template <typename T>
     static T* make(int fd) {
 	T* c = new T();
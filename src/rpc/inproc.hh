@@ -0,0 +1,289 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <ev++.h>
+
+#include "proto/fastrpc_proto.hh"
+#include "rpc/grequest.hh"
+#include "rpc/gcrequest.hh"
+#include "rpc/libev_loop.hh"
+#include "rpc/rpc_server_base.hh"
+#include "rpc_common/compiler.hh"
+#include "rpc_common/util.hh"
+
+// Calls to services hosted by the same process (see
+// async_rpcc::set_local). Requests and replies are handed over as
+// messages, without going through a transport or being serialized.
+// On the server's thread the service is called directly; from other
+// threads calls travel through single-producer single-consumer queues
+// and wake up the other nn_loop with ev::async.
+
+namespace rpc {
+
+/** Unbounded single-producer single-consumer queue of pointers. */
+template <typename E>
+struct spsc_queue {
+    spsc_queue() : tpos_(0), hpos_(0) {
+        head_ = tail_ = new chunk;
+    }
+    ~spsc_queue() {
+        while (head_) {
+            chunk* next = head_->next_.load(std::memory_order_relaxed);
+            delete head_;
+            head_ = next;
+        }
+    }
+    // producer
+    void push(E e) {
+        if (tpos_ == N) {
+            chunk* c = new chunk;
+            tail_->next_.store(c, std::memory_order_release);
+            tail_ = c;
+            tpos_ = 0;
+        }
+        tail_->e_[tpos_] = e;
+        tail_->n_.store(++tpos_, std::memory_order_release);
+    }
+    // consumer
+    bool pop(E& e) {
+        while (true) {
+            if (hpos_ < head_->n_.load(std::memory_order_acquire)) {
+                e = head_->e_[hpos_++];
+                return true;
+            }
+            if (hpos_ < N)
+                return false;
+            chunk* next = head_->next_.load(std::memory_order_acquire);
+            if (!next)
+                return false;
+            delete head_;
+            head_ = next;
+            hpos_ = 0;
+        }
+    }
+  private:
+    enum { N = 256 };
+    struct chunk {
+        chunk() : n_(0), next_(NULL) {
+        }
+        E e_[N];
+        std::atomic<unsigned> n_;
+        std::atomic<chunk*> next_;
+    };
+    // Each end gets cache lines of its own. Padded by hand: new does
+    // not honor alignas(64) before C++17.
+    char pad0_[64];
+    chunk* tail_;
+    unsigned tpos_;
+    char pad1_[64];
+    chunk* head_;
+    unsigned hpos_;
+    char pad2_[64];
+};
+
+template <typename T> struct inproc_server;
+template <typename T> struct inproc_link;
+
+// a call in flight from an async_rpcc to an inproc_server
+template <typename T>
+struct inproc_call {
+    virtual ~inproc_call() {
+    }
+    virtual uint32_t proc() const = 0;
+    // on the server's thread
+    virtual void dispatch(rpc_server_base<T>* s, uint64_t now) = 0;
+    // on the caller's thread
+    virtual void complete() = 0;
+};
+
+/** Server side of local calls, owned by the thread that creates it. */
+template <typename T>
+struct inproc_server : public deferred_flusher {
+    inproc_server()
+        : loop_(nn_loop::get_tls_loop()), wake_(loop_->ev_loop()) {
+        wake_.set<inproc_server<T>, &inproc_server<T>::wakeup>(this);
+        wake_.start();
+    }
+    virtual ~inproc_server() {
+        mandatory_assert(links_.empty());
+        wake_.stop();
+        if (!dirty_.empty())
+            loop_->cancel_flush(this);
+    }
+    // NULL if @a proc is not served
+    virtual rpc_server_base<T>* local_service(uint32_t proc) = 0;
+    nn_loop* loop() const {
+        return loop_;
+    }
+  private:
+    nn_loop* loop_;
+    ev::async wake_;
+    std::mutex lock_;
+    std::vector<inproc_link<T>*> links_; // protected by lock_
+    std::vector<inproc_link<T>*> dirty_; // links with unannounced replies
+    std::vector<inproc_call<T>*> ready_;
+
+    void attach(inproc_link<T>* l) {
+        std::lock_guard<std::mutex> g(lock_);
+        links_.push_back(l);
+    }
+    void detach(inproc_link<T>* l) {
+        std::lock_guard<std::mutex> g(lock_);
+        links_.erase(std::find(links_.begin(), links_.end(), l));
+    }
+    void wakeup(ev::async&, int) {
+        {
+            std::lock_guard<std::mutex> g(lock_);
+            for (auto l : links_) {
+                inproc_call<T>* c;
+                while (l->requests_.pop(c))
+                    ready_.push_back(c);
+            }
+        }
+        uint64_t now = rpc::common::tstamp();
+        for (auto c : ready_)
+            c->dispatch(local_service(c->proc()), now);
+        ready_.clear();
+    }
+    void defer(inproc_link<T>* l) {
+        if (dirty_.empty())
+            loop_->defer_flush(this);
+        dirty_.push_back(l);
+    }
+    void flush_deferred() {
+        for (auto l : dirty_) {
+            l->dirty_replies_ = false;
+            l->wake_.send();
+        }
+        dirty_.clear();
+    }
+    friend struct inproc_link<T>;
+};
+
+/** Caller side of local calls, owned by the calling thread. */
+template <typename T>
+struct inproc_link : public deferred_flusher {
+    inproc_link(inproc_server<T>* s)
+        : s_(s), loop_(nn_loop::get_tls_loop()), noutstanding_(0),
+          dirty_requests_(false), dirty_replies_(false),
+          wake_(loop_->ev_loop()) {
+        if (!same_thread()) {
+            wake_.set<inproc_link<T>, &inproc_link<T>::wakeup>(this);
+            wake_.start();
+            s_->attach(this);
+        }
+    }
+    ~inproc_link() {
+        mandatory_assert(noutstanding_ == 0);
+        if (dirty_requests_)
+            loop_->cancel_flush(this);
+        if (!same_thread()) {
+            wake_.stop();
+            s_->detach(this);
+        }
+    }
+    int noutstanding() const {
+        return noutstanding_;
+    }
+    template <uint32_t PROC>
+    void call(gcrequest_typed<PROC>* q);
+    // a reply is ready, on the server's thread
+    void reply(inproc_call<T>* c) {
+        if (same_thread()) {
+            --noutstanding_;
+            c->complete();
+            return;
+        }
+        replies_.push(c);
+        if (!dirty_replies_) {
+            dirty_replies_ = true;
+            s_->defer(this);
+        }
+    }
+    // wake up the server now rather than at the end of this iteration
+    void flush() {
+        if (dirty_requests_) {
+            loop_->cancel_flush(this);
+            flush_deferred();
+        }
+    }
+  private:
+    inproc_server<T>* s_;
+    nn_loop* loop_;
+    int noutstanding_;
+    bool dirty_requests_;
+    bool dirty_replies_; // owned by the server's thread
+    ev::async wake_;
+    spsc_queue<inproc_call<T>*> requests_;
+    spsc_queue<inproc_call<T>*> replies_;
+
+    bool same_thread() const {
+        return s_->loop() == loop_;
+    }
+    void flush_deferred() {
+        dirty_requests_ = false;
+        s_->wake_.send();
+    }
+    void wakeup(ev::async&, int) {
+        inproc_call<T>* c;
+        while (replies_.pop(c)) {
+            --noutstanding_;
+            c->complete();
+        }
+    }
+    friend struct inproc_server<T>;
+};
+
+/** The server's view of a local call. The request is moved in from the
+    caller and moved back, together with the reply, on completion. */
+template <uint32_t PROC, typename T>
+struct grequest_inproc : public grequest<PROC, false>, public inproc_call<T> {
+    grequest_inproc(gcrequest_typed<PROC>* q, inproc_link<T>* l)
+        : q_(q), l_(l) {
+        std::swap(this->req_, q->req());
+        this->set_deadline(q->deadline());
+    }
+    uint32_t proc() const {
+        return PROC;
+    }
+    void dispatch(rpc_server_base<T>* s, uint64_t now) {
+        if (!s || !s->dispatch_local(this, now)) {
+            set_default_eno(&this->reply_);
+            execute();
+        }
+    }
+    void execute() {
+        l_->reply(this);
+    }
+    void complete() {
+        gcrequest_typed<PROC>* q = q_;
+        std::swap(this->req_, q->req());
+        std::swap(this->reply_, q->reply_);
+        delete this;
+        q->process_local_reply();
+    }
+  private:
+    gcrequest_typed<PROC>* q_;
+    inproc_link<T>* l_;
+};
+
+template <typename T>
+template <uint32_t PROC>
+void inproc_link<T>::call(gcrequest_typed<PROC>* q) {
+    auto c = new grequest_inproc<PROC, T>(q, this);
+    ++noutstanding_;
+    if (same_thread()) {
+        c->dispatch(s_->local_service(PROC), rpc::common::tstamp());
+        return;
+    }
+    requests_.push(c);
+    if (!dirty_requests_) {
+        dirty_requests_ = true;
+        loop_->defer_flush(this);
+    }
+}
+
+} // namespace rpc
@@ -2,9 +2,15 @@
 
 #include "rpc_common/compiler.hh"
 #include "rpc_common/spinlock.hh"
+#include "rpc_common/util.hh"
+#include "buffer_pool.hh"
+#include "timer_wheel.hh"
 #include <ev++.h>
 #include <pthread.h>
 #include <list>
+#include <vector>
+#include <mutex>
+#include <functional>
 #include <assert.h>
 
 namespace rpc {
@@ -14,6 +20,18 @@ namespace rpc {
 // on it before selecting.
 struct edge_triggered_channel {
     virtual bool drain() = 0;
+    // The loop is about to sleep: anything that arrives from now on must
+    // wake it up. True if something has already, so that it doesn't.
+    virtual bool prepare_sleep() {
+	return false;
+    }
+};
+
+// A transport with buffered output that it wants written out once per
+// loop iteration, after all callbacks have produced their output.
+struct deferred_flusher {
+    virtual ~deferred_flusher() {}
+    virtual void flush_deferred() = 0;
 };
 
 /** @brief Non-Nested Loop. The nn_loop abstraction ensures that
@@ -68,6 +86,24 @@ struct nn_loop {
     static nn_loop *get_loop(nn_loop *loop = 0) {
 	return loop ? loop : get_tls_loop();
     }
+    // Free this thread's loop, e.g. before the thread exits. Nothing may
+    // use it afterwards; get_tls_loop makes a new one.
+    static void destroy_tls_loop() {
+#if (__clang__ && __APPLE__)
+	nn_loop *tl = tls_loop_key_ ? (nn_loop *) pthread_getspecific(tls_loop_key_) : NULL;
+	if (tl)
+	    pthread_setspecific(tls_loop_key_, NULL);
+#else
+	nn_loop *tl = tls_loop_;
+	tls_loop_ = NULL;
+#endif
+	if (!tl)
+	    return;
+	struct ev_loop *raw = tl->loop_.raw_loop;
+	delete tl;
+	if (!ev_is_default_loop(raw))
+	    ev_loop_destroy(raw);
+    }
     void add_edge_triggered(edge_triggered_channel* chan) {
 	chan_.push_back(chan);
     }
@@ -79,6 +115,33 @@ struct nn_loop {
 	    }
 	assert(0 && "unknown edge-triggered channel");
     }
+    // f->flush_deferred() is called at the end of this loop iteration
+    void defer_flush(deferred_flusher* f) {
+	dirty_.push_back(f);
+    }
+    void cancel_flush(deferred_flusher* f) {
+	for (auto it = dirty_.begin(); it != dirty_.end(); ++it)
+	    if (*it == f) {
+		dirty_.erase(it);
+		return;
+	    }
+    }
+    void flush_dirty() {
+	while (!dirty_.empty()) {
+	    deferred_flusher* f = dirty_.back();
+	    dirty_.pop_back();
+	    f->flush_deferred(); // may delete f
+	}
+    }
+    // Run @a f on this loop's thread, in a later iteration. Any thread
+    // may call it.
+    void post(std::function<void()> f) {
+	{
+	    std::lock_guard<std::mutex> g(post_lock_);
+	    posted_.push_back(std::move(f));
+	}
+	post_ev_.send();
+    }
     int enter() {
         return ++ nest_;
     }
@@ -87,16 +150,38 @@ struct nn_loop {
     }
     void run_once() {
         mandatory_assert(nest_ == 1 && pthread_self() == tid_);
-	bool dispatched = false;
-	for (auto it = chan_.begin(); it != chan_.end(); ) {
-	    auto next = it;
-	    next ++;
-	    if ((*it)->drain()) // may remove itself
-	        dispatched = true;
-	    it = next;
-        }
-	if (!dispatched)
-            loop_.run(ev::ONCE);
+	// a connection that fails to flush completes its calls
+	uint64_t n = nevents_;
+	flush_dirty();
+	bool dispatched = n != nevents_;
+	if (drain_channels())
+	    dispatched = true;
+	if (dispatched)
+	    flush_dirty();
+	else if ((!busy_poll_ || !spin()) && !prepare_sleep())
+            loop_.run(ev::ONCE); // flush_check_ flushes after the callbacks
+    }
+    // Busy polling: run_once polls without blocking, edge-triggered
+    // channels included, for up to @a us microseconds before it sleeps.
+    // 0 turns it off.
+    void set_busy_poll(int us) {
+	busy_poll_ = us;
+    }
+    int busy_poll() const {
+	return busy_poll_;
+    }
+    // CPU microseconds of this thread spent polling without finding an
+    // event (the poll that finds one runs its callbacks and is not
+    // counted), and the part of it spent in spins that found nothing at all
+    uint64_t spin_time() const {
+	return spin_time_;
+    }
+    uint64_t spin_idle() const {
+	return spin_idle_;
+    }
+    // called by transports on readiness; busy polling stops at the first
+    void count_event() {
+	++nevents_;
     }
     bool has_edge_triggered() const {
 	return !chan_.empty();
@@ -123,18 +208,117 @@ struct nn_loop {
     void post_fork() {
         loop_.post_fork();
     }
+    // buffer memory shared by the transports running on this loop
+    buffer_pool& buffers() {
+        return buffers_;
+    }
+    // small objects made on this loop, see gcrequest_pooled
+    object_pool& objects() {
+        return objects_;
+    }
+    // timeouts of things that run on this loop, such as call deadlines
+    timer_wheel& timers() {
+        return timers_;
+    }
   private:
 #if (__clang__ && __APPLE__)
     static pthread_key_t tls_loop_key_;
 #else
     static __thread nn_loop *tls_loop_;
 #endif
-    nn_loop(const ev::loop_ref &loop) : nest_(0), loop_(loop) {
+    nn_loop(const ev::loop_ref &loop)
+	: nest_(0), loop_(loop), timers_(loop), flush_check_(loop), post_ev_(loop), busy_poll_(0),
+	  nevents_(0), spin_time_(0), spin_idle_(0) {
         tid_ = pthread_self();
+	flush_check_.set<nn_loop, &nn_loop::flush_check>(this);
+	// Pending watchers of equal priority run latest queued first, so
+	// at the default priority the check would run before the I/O
+	// callbacks of its iteration, and their output would wait for the
+	// next one. The lowest priority runs it after them.
+	ev_set_priority(static_cast<ev_check*>(&flush_check_), EV_MINPRI);
+	flush_check_.start();
+	post_ev_.set<nn_loop, &nn_loop::run_posted>(this);
+	post_ev_.start();
+	// neither watcher alone must keep the loop alive
+	loop_.unref();
+	loop_.unref();
+    }
+    ~nn_loop() {
+	// undo the unrefs of the constructor before stopping the watchers
+	loop_.ref();
+	loop_.ref();
+	flush_check_.stop();
+	post_ev_.stop();
+    }
+    void flush_check(ev::check&, int) {
+	flush_dirty();
+    }
+    void run_posted(ev::async&, int) {
+	std::vector<std::function<void()> > fs;
+	{
+	    std::lock_guard<std::mutex> g(post_lock_);
+	    fs.swap(posted_);
+	}
+	for (auto& f : fs)
+	    f();
+    }
+    bool drain_channels() {
+	bool dispatched = false;
+	for (auto it = chan_.begin(); it != chan_.end(); ) {
+	    auto next = it;
+	    next ++;
+	    if ((*it)->drain()) // may remove itself
+	        dispatched = true;
+	    it = next;
+        }
+	return dispatched;
+    }
+    bool prepare_sleep() {
+	bool ready = false;
+	for (auto c : chan_)
+	    if (c->prepare_sleep())
+		ready = true;
+	return ready;
+    }
+    // true if an event came within the budget
+    bool spin() {
+	uint64_t n = nevents_;
+	uint64_t start = rpc::common::tstamp();
+	// the budget is wall time, the counters are this thread's CPU time
+	uint64_t cpu_start = rpc::common::thread_cputime(), cpu_poll = cpu_start, cpu_now;
+	while (1) {
+	    loop_.run(ev::NOWAIT);
+	    if (drain_channels())
+		flush_dirty();
+	    cpu_now = rpc::common::thread_cputime();
+	    if (n != nevents_) {
+		// the poll that found the event ran its callbacks: not spinning
+		spin_time_ += cpu_poll - cpu_start;
+		return true;
+	    }
+	    if (rpc::common::tstamp() - start >= uint64_t(busy_poll_))
+		break;
+	    cpu_poll = cpu_now;
+	}
+	spin_time_ += cpu_now - cpu_start;
+	spin_idle_ += cpu_now - cpu_start;
+	return false;
     }
     pthread_t tid_;
     int nest_;
     ev::loop_ref loop_;
+    buffer_pool buffers_;
+    object_pool objects_;
+    timer_wheel timers_;
+    ev::check flush_check_;
+    std::vector<deferred_flusher*> dirty_;
+    ev::async post_ev_;
+    std::mutex post_lock_;
+    std::vector<std::function<void()> > posted_;
+    int busy_poll_;
+    uint64_t nevents_;
+    uint64_t spin_time_;
+    uint64_t spin_idle_;
 
     std::list<edge_triggered_channel*> chan_;
 };
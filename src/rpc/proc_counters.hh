@@ -37,6 +37,15 @@ template <unsigned NPROC> struct proc_counters<NPROC, true> {
     inline void clear() {
 	bzero(c_, sizeof(c_));
     }
+    inline void merge(const proc_counters<NPROC, true>& x) {
+	for (uint32_t i = 0; i < NPROC; ++i) {
+	    for (int t = 0; t < 4; ++t) {
+		c_[i].count[t] += x.c_[i].count[t];
+		c_[i].bytes[t] += x.c_[i].bytes[t];
+	    }
+	    c_[i].time += x.c_[i].time;
+	}
+    }
     inline void print(FILE* fp) {
 	fprintf(fp, "%20s %10s %10s\n",
 	        "proc", "request", "time/req");
@@ -74,6 +83,8 @@ template <unsigned NPROC> struct proc_counters<NPROC, false> {
     }
     inline void clear() {
     }
+    inline void merge(const proc_counters<NPROC, false>&) {
+    }
     inline void print(FILE* fp) {
     }
 };
@@ -0,0 +1,169 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+
+#include "rpc/libev_loop.hh"
+#include "rpc_common/sock_helper.hh"
+#include "rpc_common/util.hh"
+
+// Name resolution off the event loop. Resolved hosts are cached; once an
+// entry is older than ttl(), lookups keep answering from it while a
+// background thread resolves the host again. Only the first lookup of a
+// host waits for getaddrinfo, and resolve() avoids even that. A host
+// that failed to resolve fails again at once for negative_ttl().
+
+namespace rpc {
+
+struct resolver {
+    typedef std::vector<rpc::common::endpoint> addrs_type;
+    typedef std::function<void(const addrs_type&)> callback_type;
+
+    // never destroyed: at exit, the thread may be stuck in getaddrinfo
+    static resolver& get() {
+	static resolver* r = new resolver;
+	return *r;
+    }
+    // All addresses of @a host, with @a port. Blocks only if @a host
+    // was never resolved.
+    bool lookup(const std::string& host, int port, addrs_type& out) {
+	std::unique_lock<std::mutex> g(lock_);
+	entry& e = cache_[host];
+	if (e.addrs.empty()) {
+	    if (failed(e))
+		return false;
+	    g.unlock();
+	    addrs_type a;
+	    bool ok = rpc::common::sock_helper::resolve(host.c_str(), 0, a);
+	    g.lock();
+	    if (!ok) {
+		cache_[host].failed_at = rpc::common::tstamp();
+		return false;
+	    }
+	    store(cache_[host], a);
+	} else if (stale(e))
+	    refresh(host, e);
+	out = cache_[host].addrs;
+	for (auto& x : out)
+	    x.set_port(port);
+	return true;
+    }
+    // Resolves @a host in the background if it is not cached, then calls
+    // @a cb on this thread's nn_loop. No addresses means failure.
+    void resolve(const std::string& host, int port, callback_type cb) {
+	nn_loop* loop = nn_loop::get_tls_loop();
+	std::lock_guard<std::mutex> g(lock_);
+	entry& e = cache_[host];
+	if (e.addrs.empty() && !failed(e)) {
+	    e.waiters.push_back(waiter(loop, port, cb));
+	    refresh(host, e);
+	    return;
+	}
+	if (stale(e))
+	    refresh(host, e);
+	post(waiter(loop, port, cb), e.addrs);
+    }
+    // Whether lookup() answers @a host without blocking
+    bool cached(const std::string& host) {
+	std::lock_guard<std::mutex> g(lock_);
+	auto it = cache_.find(host);
+	return it != cache_.end() && (!it->second.addrs.empty() || failed(it->second));
+    }
+    // Seconds a resolution stays fresh. Pass a negative value to query.
+    static double ttl(double seconds = -1) {
+	static double t = 60;
+	if (seconds >= 0)
+	    t = seconds;
+	return t;
+    }
+    // Seconds a failure is remembered. Pass a negative value to query.
+    static double negative_ttl(double seconds = -1) {
+	static double t = 1;
+	if (seconds >= 0)
+	    t = seconds;
+	return t;
+    }
+
+  private:
+    struct waiter {
+	waiter(nn_loop* l, int p, callback_type c) : loop(l), port(p), cb(c) {
+	}
+	nn_loop* loop;
+	int port;
+	callback_type cb;
+    };
+    struct entry {
+	entry() : at(0), failed_at(0), refreshing(false) {
+	}
+	addrs_type addrs;
+	uint64_t at;  // when addrs were resolved
+	uint64_t failed_at;  // of the last failure, if none resolved
+	bool refreshing;
+	std::vector<waiter> waiters;
+    };
+    std::mutex lock_;
+    std::condition_variable cv_;
+    std::map<std::string, entry> cache_;
+    std::deque<std::string> queue_;
+    std::thread thread_;
+
+    resolver() {
+    }
+    static bool stale(const entry& e) {
+	return rpc::common::tstamp() - e.at > ttl() * 1000000;
+    }
+    static bool failed(const entry& e) {
+	return e.failed_at && rpc::common::tstamp() - e.failed_at < negative_ttl() * 1000000;
+    }
+    static void store(entry& e, const addrs_type& a) {
+	e.addrs = a;
+	e.at = rpc::common::tstamp();
+	e.failed_at = 0;
+    }
+    static void post(const waiter& w, addrs_type a) {
+	for (auto& x : a)
+	    x.set_port(w.port);
+	callback_type cb = w.cb;
+	w.loop->post([cb, a]() { cb(a); });
+    }
+    // with lock_ held
+    void refresh(const std::string& host, entry& e) {
+	if (e.refreshing)
+	    return;
+	e.refreshing = true;
+	queue_.push_back(host);
+	if (!thread_.joinable())
+	    thread_ = std::thread(&resolver::run, this);
+	cv_.notify_one();
+    }
+    void run() {
+	std::unique_lock<std::mutex> g(lock_);
+	while (true) {
+	    cv_.wait(g, [this] { return !queue_.empty(); });
+	    std::string host = queue_.front();
+	    queue_.pop_front();
+	    g.unlock();
+	    addrs_type a;
+	    bool ok = rpc::common::sock_helper::resolve(host.c_str(), 0, a);
+	    g.lock();
+	    entry& e = cache_[host];
+	    // on failure, keep answering with what worked before
+	    if (ok)
+		store(e, a);
+	    else if (e.addrs.empty())
+		e.failed_at = rpc::common::tstamp();
+	    e.refreshing = false;
+	    std::vector<waiter> ws;
+	    ws.swap(e.waiters);
+	    for (auto& w : ws)
+		post(w, e.addrs);
+	}
+    }
+};
+
+}
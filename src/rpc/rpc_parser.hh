@@ -33,6 +33,40 @@ struct rpc_header {
     uint32_t latency() const {
 	return proc_ & 0xffffff;
     }
+    // A request may carry the caller's remaining time budget, in
+    // microseconds, in a word between the header and the message;
+    // payload_length() counts it.
+    enum { budget_flag = 1 << 23 };
+    bool has_budget() const {
+	return request() && (proc_ & budget_flag);
+    }
+    uint32_t ext_length() const {
+	return has_budget() ? sizeof(uint32_t) : 0;
+    }
+    uint32_t budget() const {
+	return *reinterpret_cast<const uint32_t*>(this + 1);
+    }
+    // after set_mproc, with room for ext_length() bytes
+    void set_budget(uint32_t us) {
+	proc_ |= budget_flag;
+	*reinterpret_cast<uint32_t*>(this + 1) = us;
+    }
+    // A request frame without a message that cancels the request with
+    // the same seq_, see async_rpcc::cancel
+    enum { cancel_flag = 1 << 22 };
+    bool cancel() const {
+	return request() && (proc_ & cancel_flag);
+    }
+    void set_cancel() {
+	proc_ |= cancel_flag;
+    }
+    // whether the lengths add up; a peer that sends otherwise is broken
+    // or hostile
+    bool well_formed() const {
+	return (len_ & 0x7fffffff) >= sizeof(rpc_header)
+	    && payload_length() >= ext_length()
+	    && !(cancel() && payload_length());
+    }
   private:
     uint32_t len_;
   public:
@@ -42,27 +76,37 @@ struct rpc_header {
 };
 
 struct parser {
-    parser(): reqbody_() {
+    parser(): reqbody_(), deadline_(), bad_(false) {
     }
     void reset() {
         reqbody_ = 0;
+        deadline_ = 0;
     }
-    // must be called in a loop until it returns false
+    // must be called in a loop until it returns false; then bad_ tells
+    // if it stopped at a malformed frame
     template <typename H, typename T>
     bool parse(uint8_t *&buf, uint32_t &len, T *c) {
 	assert(!reqbody_);
         check_unaligned_access();
 
 	uint32_t need = sizeof(H);
-	if (need <= len)
-	    need += reinterpret_cast<H *>(buf)->payload_length();
+	if (need <= len) {
+	    const H *h = reinterpret_cast<H *>(buf);
+	    if (!h->well_formed()) {
+		bad_ = true;
+		return false;
+	    }
+	    need += h->payload_length();
+	}
 	if (need > len) {
 	    c->advance(buf, need);
 	    return false;
 	}
 
-	reqbody_ = buf + sizeof(H);
-	reqlen_ = need - sizeof(H);
+	uint32_t ext = reinterpret_cast<H *>(buf)->ext_length();
+	hdr_ = buf;
+	reqbody_ = buf + sizeof(H) + ext;
+	reqlen_ = need - sizeof(H) - ext;
 
 	buf += need;
 	len -= need;
@@ -72,15 +116,19 @@ struct parser {
     template <typename H>
     inline H *header() const {
 	assert(reqbody_);
-	return reinterpret_cast<H *>(reqbody_ - sizeof(H));
+	return reinterpret_cast<H *>(hdr_);
     }
 
     template <typename T>
     inline void parse_message(T &m) {
         m.ParseFromArray(reqbody_, reqlen_);
     }
+    uint8_t *hdr_;
     uint8_t *reqbody_;
     uint32_t reqlen_;
+    // of the current request, a rpc::common::tstamp(); 0 if it has none
+    uint64_t deadline_;
+    bool bad_;
 };
 
 } // namespace rpc
@@ -3,6 +3,12 @@
 #include <ev++.h>
 #include <thread>
 #include <list>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
 #include "grequest.hh"
 #include "libev_loop.hh"
 #include "rpc_common/sock_helper.hh"
@@ -13,38 +19,138 @@
 namespace rpc {
 
 template <typename T>
-struct async_rpc_server : public rpc_handler<T> {
+struct async_rpc_server : public rpc_handler<T>, public inproc_server<T> {
     typedef async_rpc_server<T> self;
 
-    async_rpc_server(int port, const std::string& h) : listener_ev_(nn_loop::get_tls_loop()->ev_loop()) {
-        listener_ = rpc::common::sock_helper::listen(h, port, 100);
+    // see sock_helper::listen about @a reuseport
+    async_rpc_server(int port, const std::string& h, bool reuseport = false)
+        : high_wm_(32 << 20), low_wm_(8 << 20), nthrottled_(0), nthrottle_events_(0),
+          listener_ev_(nn_loop::get_tls_loop()->ev_loop()),
+          retry_ev_(nn_loop::get_tls_loop()->ev_loop()), reserve_fd_(-1),
+          max_conns_(0), nshed_(0), nexpired_(0) {
+        listener_ = rpc::common::sock_helper::listen(h, port, 100, reuseport);
         rpc::common::sock_helper::make_nodelay(listener_);
-        listener_ev_.set<self, &self::accept_one>(this);
-        listener_ev_.start(listener_, ev::READ);
+        start_listening();
+    }
+    // serves on the unix domain socket at path; use with unixnet
+    explicit async_rpc_server(const std::string& path)
+        : high_wm_(32 << 20), low_wm_(8 << 20), nthrottled_(0), nthrottle_events_(0),
+          path_(path), listener_ev_(nn_loop::get_tls_loop()->ev_loop()),
+          retry_ev_(nn_loop::get_tls_loop()->ev_loop()), reserve_fd_(-1),
+          max_conns_(0), nshed_(0), nexpired_(0) {
+        listener_ = rpc::common::sock_helper::listen_unix(path, 100);
+        start_listening();
+    }
+    // serves calls from this process only, see async_rpcc::set_local
+    async_rpc_server()
+        : high_wm_(32 << 20), low_wm_(8 << 20), nthrottled_(0), nthrottle_events_(0),
+          listener_(-1), listener_ev_(nn_loop::get_tls_loop()->ev_loop()),
+          retry_ev_(nn_loop::get_tls_loop()->ev_loop()), reserve_fd_(-1),
+          max_conns_(0), nshed_(0), nexpired_(0) {
     }
 
     ~async_rpc_server() {
+        stop_listening();
+        for (auto w : hellos_) {
+            close(w->fd);
+            delete w;
+        }
+    }
+    // accept no more connections
+    void stop_listening() {
+        listener_ev_.stop();
+        retry_ev_.stop();
         if (listener_ >= 0)
 	    close(listener_);
+        listener_ = -1;
+        if (reserve_fd_ >= 0)
+            close(reserve_fd_);
+        reserve_fd_ = -1;
+        if (!path_.empty())
+            unlink(path_.c_str());
+        path_.clear();
+    }
+    // Stop accepting while @a n connections are open; those beyond wait
+    // in the listen backlog. 0, the default, is unlimited.
+    void set_max_connections(size_t n) {
+        max_conns_ = n;
+        resume_accept();
+    }
+    // connections closed right away because no fd was left
+    uint64_t nshed() const {
+        return nshed_;
+    }
+    // requests dropped because their caller's deadline passed before
+    // they were dispatched
+    uint64_t nexpired() const {
+        return nexpired_;
     }
 
+    // NULL if the transport could not be made; the provider has closed
+    // @a fd then
     async_rpcc<T>* register_rpcc(int fd) {
-        async_rpcc<T> *c = new async_rpcc<T>(new onetime_tcpp(fd), this, true, &opcount_);
-        mandatory_assert(c);
+        async_rpcc<T> *c = new async_rpcc<T>(new onetime_tcpp(fd), this, false, &opcount_);
+        if (!c->connect()) {
+            delete c;
+            return NULL;
+        }
+        c->set_watermarks(high_wm_, low_wm_);
         clients_.push_back(c);
         return c;
     }
 
-    void accept_one(ev::io &e, int flags) {
-        int s1 = rpc::common::sock_helper::accept(listener_);
-        assert(s1 >= 0);
-        register_rpcc(s1);
+    // Takes the whole backlog, up to accept_batch connections, so that
+    // a burst of connects costs one wakeup per batch.
+    void accept_ready(ev::io &, int) {
+        for (int i = 0; i < accept_batch; ++i) {
+            if (max_conns_ && nconns() >= max_conns_) {
+                listener_ev_.stop();
+                return;
+            }
+            int s1 = rpc::common::sock_helper::accept_nonblock(listener_);
+            if (s1 >= 0) {
+                if (has_handshake<T>::value)
+                    hellos_.push_back(new hello_wait(this, s1));
+                else
+                    register_rpcc(s1);
+                continue;
+            }
+            // the connection failed, not the listener
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+                continue;
+            if (errno == EMFILE || errno == ENFILE) {
+                shed();
+                return;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // e.g. ENOBUFS: the listener stays readable, so wait
+                perror("accept");
+                back_off();
+            }
+            return;
+        }
     }
 
     proc_counters<app_param::nproc, true>& get_opcount() {
         return opcount_;
     }
 
+    // Output watermarks of connections accepted from now on: a peer
+    // with @a high bytes of unsent replies is not read from until its
+    // backlog drops to @a low. 0 disables.
+    void set_watermarks(size_t high, size_t low) {
+        high_wm_ = high;
+        low_wm_ = low;
+    }
+    // peers currently throttled
+    unsigned nthrottled() const {
+        return nthrottled_;
+    }
+    // times any peer has been throttled
+    uint64_t nthrottle_events() const {
+        return nthrottle_events_;
+    }
+
     void register_service(rpc_server_base<T>* s) {
         auto pl = s->proclist();
         for (auto p : pl) {
@@ -55,12 +161,22 @@ struct async_rpc_server : public rpc_handler<T> {
         }
         unique_.push_back(s);
     }
+    rpc_server_base<T>* local_service(uint32_t proc) {
+        return proc < sp_.size() ? sp_[proc] : NULL;
+    }
 
     void handle_rpc(async_rpcc<T>* c, parser& p) {
         rpc_header *h = p.header<rpc_header>();
         auto s = sp_[h->proc()];
         mandatory_assert(s);
-        s->dispatch(p, c, rpc::common::tstamp());
+        uint64_t now = rpc::common::tstamp();
+        // the caller has given up, and times the call out itself
+        if (p.deadline_ && p.deadline_ <= now) {
+            ++nexpired_;
+            c->drop_request(h->seq_);
+            return;
+        }
+        s->dispatch(p, c, now);
     }
 
     void handle_client_failure(async_rpcc<T>* c) {
@@ -69,6 +185,7 @@ struct async_rpc_server : public rpc_handler<T> {
         for (auto it = clients_.begin(); it != clients_.end(); ++it)
             if (*it == c) {
                 clients_.erase(it);
+                resume_accept();
                 return;
             }
         assert(0 && "connection not found? Impossible!");
@@ -76,6 +193,28 @@ struct async_rpc_server : public rpc_handler<T> {
     void handle_post_failure(async_rpcc<T>* c) {
 	delete c;
     }
+    // see async_rpcc::migrate
+    void handle_detached(async_rpcc<T>* c) {
+        if (c->throttled())
+            --nthrottled_;
+        clients_.remove(c);
+        resume_accept();
+    }
+    // Take over @a c, which another server's loop handed to ours. Call it
+    // from the adopt function passed to async_rpcc::migrate.
+    void adopt(async_rpcc<T>* c) {
+        c->set_handler(this, &opcount_);
+        if (c->throttled())
+            ++nthrottled_;
+        clients_.push_back(c);
+    }
+    void handle_throttle(async_rpcc<T>* c, bool throttled) {
+        if (throttled) {
+            ++nthrottled_;
+            ++nthrottle_events_;
+        } else
+            --nthrottled_;
+    }
     std::list<async_rpcc<T>*>& all_rpcc() {
         return clients_;
     }
@@ -85,8 +224,409 @@ struct async_rpc_server : public rpc_handler<T> {
     std::vector<rpc_server_base<T>*> unique_; // service provider
     std::vector<rpc_server_base<T>*> sp_; // service provider
     proc_counters<app_param::nproc, true> opcount_;
+    size_t high_wm_;
+    size_t low_wm_;
+    unsigned nthrottled_;
+    uint64_t nthrottle_events_;
+    std::string path_; // unix domain socket, if any
     int listener_;
     ev::io listener_ev_;
+    ev::timer retry_ev_;  // accepting again after accept failed
+    int reserve_fd_;      // given up to accept and close when out of fds
+    size_t max_conns_;
+    uint64_t nshed_;
+    uint64_t nexpired_;
+
+    enum { accept_batch = 256 };
+    // seconds a client gets to start the handshake
+    enum { hello_timeout = 5 };
+
+    // An accepted connection whose provider has a handshake (see
+    // has_handshake), until the client's first message is readable:
+    // the server loop must not block on a slow or silent client.
+    struct hello_wait {
+        hello_wait(self* s, int fd)
+            : s(s), fd(fd), io(nn_loop::get_tls_loop()->ev_loop()),
+              timer(nn_loop::get_tls_loop()->ev_loop()) {
+            io.set<hello_wait, &hello_wait::ready>(this);
+            io.start(fd, ev::READ);
+            timer.set<hello_wait, &hello_wait::expired>(this);
+            timer.start(hello_timeout);
+        }
+        ~hello_wait() {
+            io.stop();
+            timer.stop();
+        }
+        void ready(ev::io&, int) {
+            s->handshake(this, true);
+        }
+        void expired(ev::timer&, int) {
+            s->handshake(this, false);
+        }
+        self* s;
+        int fd;
+        ev::io io;
+        ev::timer timer;
+    };
+    std::list<hello_wait*> hellos_;
+
+    size_t nconns() const {
+        return clients_.size() + hellos_.size();
+    }
+    // Make the transport of @a w's connection, or close it if the client
+    // never spoke. A failed handshake only costs that connection.
+    void handshake(hello_wait* w, bool ready) {
+        hellos_.remove(w);
+        int fd = w->fd;
+        delete w;
+        if (!ready || !register_rpcc(fd)) {
+            if (!ready)
+                close(fd);
+            fprintf(stderr, "async_rpc_server: handshake failed\n");
+        }
+        resume_accept();
+    }
+
+    void start_listening() {
+        rpc::common::sock_helper::make_nonblock(listener_);
+        reserve_fd_ = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        listener_ev_.set<self, &self::accept_ready>(this);
+        listener_ev_.start(listener_, ev::READ);
+        retry_ev_.set<self, &self::retry>(this);
+    }
+    void resume_accept() {
+        if (listener_ >= 0 && !listener_ev_.is_active() && !retry_ev_.is_active()
+            && (!max_conns_ || nconns() < max_conns_))
+            listener_ev_.start(listener_, ev::READ);
+    }
+    // Out of fds: use the reserve one to take the connection at the head
+    // of the backlog and close it, so that its client hears about it
+    // instead of waiting, then pause for a while.
+    void shed() {
+        if (reserve_fd_ >= 0) {
+            close(reserve_fd_);
+            int s1 = ::accept(listener_, NULL, NULL);
+            if (s1 >= 0) {
+                close(s1);
+                ++nshed_;
+            }
+            reserve_fd_ = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        }
+        back_off();
+    }
+    void back_off() {
+        listener_ev_.stop();
+        retry_ev_.start(0.1);
+    }
+    void retry(ev::timer&, int) {
+        resume_accept();
+    }
+};
+
+/** Serves a port with N threads, each running its own nn_loop and
+    async_rpc_server on a SO_REUSEPORT listener. The services are shared
+    by all threads, so their dispatch and client_failure must be
+    thread-safe. With set_rebalance, connections move from busy threads
+    to idle ones. */
+template <typename T>
+struct multi_loop_rpc_server {
+    typedef multi_loop_rpc_server<T> self;
+    typedef proc_counters<app_param::nproc, true> counters_type;
+
+    multi_loop_rpc_server(int port, const std::string& h, int nthreads = 0)
+        : port_(port), h_(h), high_wm_(32 << 20), low_wm_(8 << 20),
+          max_conns_(0), drain_timeout_(1), balance_interval_(0), imbalance_(1.5),
+          min_load_(1000), nready_(0), stopping_(false), nmoving_(0), nmigrated_(0) {
+        if (nthreads <= 0)
+            nthreads = std::max(1u, std::thread::hardware_concurrency());
+        workers_.resize(nthreads);
+    }
+    ~multi_loop_rpc_server() {
+        stop();
+    }
+    // before start
+    void register_service(rpc_server_base<T>* s) {
+        mandatory_assert(!nready_);
+        services_.push_back(s);
+    }
+    // see async_rpc_server::set_watermarks; before start
+    void set_watermarks(size_t high, size_t low) {
+        high_wm_ = high;
+        low_wm_ = low;
+    }
+    // see async_rpc_server::set_max_connections; per thread, before start
+    void set_max_connections(size_t n) {
+        max_conns_ = n;
+    }
+    // On stop, connections get up to @a seconds to receive the replies
+    // of calls in progress before they are closed.
+    void set_drain_timeout(double seconds) {
+        drain_timeout_ = seconds;
+    }
+    // Every @a seconds, a thread that served over @a imbalance times as
+    // many requests as the least busy one, and at least @a min_load,
+    // moves a connection there that carries up to half the difference
+    // (see async_rpcc::migrate). 0 seconds, the default, turns it off.
+    // Before start; needs can_migrate<T>.
+    void set_rebalance(double seconds, double imbalance = 1.5, uint64_t min_load = 1000) {
+        mandatory_assert(!seconds || can_migrate<T>::value);
+        balance_interval_ = seconds;
+        imbalance_ = imbalance;
+        min_load_ = min_load;
+    }
+    // connections moved by the rebalancer
+    uint64_t nmigrated() const {
+        return nmigrated_;
+    }
+    // Returns once every thread listens.
+    void start() {
+        mandatory_assert(!nready_);
+        stopping_ = false;
+        std::unique_lock<std::mutex> g(lock_);
+        stopped_.clear();
+        for (auto& w : workers_)
+            w = new worker(this);
+        for (auto w : workers_)
+            w->thread = std::thread(&self::run, this, w);
+        cv_.wait(g, [this] { return nready_ == workers_.size(); });
+    }
+    // Stops accepting, lets calls in progress finish, closes every
+    // connection and joins the threads.
+    void stop() {
+        if (!nready_)
+            return;
+        // no connection moves from now on, see rebalance
+        stopping_ = true;
+        for (auto w : workers_)
+            w->loop->post([w] { w->stop = true; });
+        for (auto w : workers_)
+            w->thread.join();
+        {
+            std::lock_guard<std::mutex> g(lock_);
+            nready_ = 0;
+        }
+        for (auto w : workers_)
+            delete w;
+    }
+    int nthreads() const {
+        return workers_.size();
+    }
+    // the server of thread @a i, e.g. for async_rpcc::set_local from
+    // that thread
+    async_rpc_server<T>* server(int i) {
+        return workers_[i]->server;
+    }
+    nn_loop* loop(int i) {
+        return workers_[i]->loop;
+    }
+    // the sum of every thread's counters; any thread may call it,
+    // including from a handler
+    counters_type get_opcount() {
+        std::unique_lock<std::mutex> g(lock_);
+        if (!nready_)
+            return stopped_;
+        // Each thread reads its own counters. The calling one, if it is a
+        // worker, is busy running us, so it answers this and any other
+        // poll while it waits. One that exits first leaves them in
+        // stopped_.
+        int me = -1;
+        for (size_t i = 0; i < workers_.size(); ++i)
+            if (workers_[i]->loop && workers_[i]->id == std::this_thread::get_id())
+                me = i;
+        auto poll = std::make_shared<opcount_poll>(workers_.size());
+        polls_.push_back(poll);
+        for (size_t i = 0; i < workers_.size(); ++i)
+            if (workers_[i]->loop && int(i) != me)
+                workers_[i]->loop->post([this, i, poll] {
+                        std::lock_guard<std::mutex> g(lock_);
+                        answer(i, poll.get());
+                    });
+        cv_.notify_all();
+        while (1) {
+            if (me >= 0)
+                for (auto& p : polls_)
+                    answer(me, p.get());
+            size_t i = 0;
+            while (i < workers_.size() && (!workers_[i]->loop || poll->answered[i]))
+                ++i;
+            if (i == workers_.size())
+                break;
+            cv_.wait(g);
+        }
+        poll->done = true;
+        polls_.erase(std::find(polls_.begin(), polls_.end(), poll));
+        counters_type sum = stopped_;
+        for (size_t i = 0; i < workers_.size(); ++i)
+            if (workers_[i]->loop)
+                sum.merge(poll->counts[i]);
+        return sum;
+    }
+
+  private:
+    struct worker {
+        worker(self* m) : m(m), loop(NULL), server(NULL), stop(false), load(0) {
+        }
+        void rebalance(ev::timer&, int) {
+            m->rebalance(this, std::integral_constant<bool, can_migrate<T>::value>());
+        }
+        self* m;
+        std::thread thread;
+        std::thread::id id;
+        nn_loop* loop;  // NULL once the thread is done with it
+        async_rpc_server<T>* server;
+        bool stop;
+        ev::timer balance;
+        std::atomic<uint64_t> load;  // requests served in the last interval
+        std::unordered_map<async_rpcc<T>*, uint64_t> nserved;
+    };
+    // a get_opcount in progress
+    struct opcount_poll {
+        opcount_poll(size_t n) : counts(n), answered(n), done(false) {
+        }
+        std::vector<counters_type> counts;
+        std::vector<bool> answered;
+        bool done;  // later answers are ignored
+    };
+    // Keeps every thread running while a connection is on its way to
+    // one of them; held by the adopt function.
+    struct move_token {
+        move_token(std::atomic<int>& n) : n_(n) {
+            ++n_;
+        }
+        ~move_token() {
+            --n_;
+        }
+        std::atomic<int>& n_;
+    };
+    int port_;
+    std::string h_;
+    size_t high_wm_;
+    size_t low_wm_;
+    size_t max_conns_;
+    double drain_timeout_;
+    double balance_interval_;
+    double imbalance_;
+    uint64_t min_load_;
+    std::vector<rpc_server_base<T>*> services_;
+    std::vector<worker*> workers_;
+    std::mutex lock_;
+    std::condition_variable cv_;
+    std::vector<std::shared_ptr<opcount_poll> > polls_;  // in progress
+    size_t nready_;
+    counters_type stopped_;  // of the threads that have stopped
+    std::atomic<bool> stopping_;
+    std::atomic<int> nmoving_;
+    std::atomic<uint64_t> nmigrated_;
+
+    void run(worker* w) {
+        serve(w);
+        nn_loop::destroy_tls_loop();
+    }
+    void serve(worker* w) {
+        nn_loop* loop = nn_loop::get_tls_loop();
+        async_rpc_server<T> s(port_, h_, true);
+        s.set_watermarks(high_wm_, low_wm_);
+        s.set_max_connections(max_conns_);
+        for (auto x : services_)
+            s.register_service(x);
+        {
+            std::lock_guard<std::mutex> g(lock_);
+            w->id = std::this_thread::get_id();
+            w->loop = loop;
+            w->server = &s;
+            ++nready_;
+            cv_.notify_all();
+        }
+        if (balance_interval_ > 0) {
+            w->balance.set(loop->ev_loop());
+            w->balance.template set<worker, &worker::rebalance>(w);
+            w->balance.start(balance_interval_, balance_interval_);
+        }
+        loop->enter();
+        while (!w->stop)
+            loop->run_once();
+        w->balance.stop();
+        s.stop_listening();
+        // wake up now and then to check on the connections
+        ev::timer tick(loop->ev_loop());
+        tick.set<self, &self::tick>(this);
+        tick.start(0.01, 0.01);
+        uint64_t deadline = rpc::common::tstamp() + uint64_t(drain_timeout_ * 1000000);
+        bool hangup = false;
+        while (!s.all_rpcc().empty() || nmoving_) {
+            hangup = hangup || rpc::common::tstamp() >= deadline;
+            // a peer sees EOF once it has all its replies
+            for (auto c : s.all_rpcc())
+                if (hangup || c->idle())
+                    c->shutdown();
+            loop->run_once();
+        }
+        tick.stop();
+        loop->leave();
+        std::lock_guard<std::mutex> g(lock_);
+        stopped_.merge(s.get_opcount());
+        w->loop = NULL;
+        cv_.notify_all();  // for get_opcount
+    }
+    void tick(ev::timer&, int) {
+    }
+    // thread @a i's counters for @a p; with lock_ held, on that thread
+    void answer(size_t i, opcount_poll* p) {
+        if (p->done || p->answered[i])
+            return;
+        p->counts[i].merge(workers_[i]->server->get_opcount());
+        p->answered[i] = true;
+        cv_.notify_all();
+    }
+
+    void rebalance(worker*, std::false_type) {
+    }
+    void rebalance(worker* w, std::true_type) {
+        // requests served by each connection since the last time
+        std::unordered_map<async_rpcc<T>*, uint64_t> nserved;
+        std::vector<std::pair<uint64_t, async_rpcc<T>*> > delta;
+        uint64_t load = 0;
+        for (auto c : w->server->all_rpcc()) {
+            auto it = w->nserved.find(c);
+            uint64_t d = 0;
+            if (it != w->nserved.end() && it->second <= c->nserved())
+                d = c->nserved() - it->second;
+            nserved[c] = c->nserved();
+            delta.push_back(std::make_pair(d, c));
+            load += d;
+        }
+        w->nserved.swap(nserved);
+        w->load = load;
+
+        worker* cold = NULL;
+        for (auto x : workers_)
+            if (x != w && (!cold || x->load < cold->load))
+                cold = x;
+        if (!cold || load < min_load_ || load < imbalance_ * cold->load)
+            return;
+        // Moving more than half the difference would only move the hot
+        // spot, so one heavy client stays where it is.
+        uint64_t target = (load - cold->load) / 2;
+        async_rpcc<T>* best = NULL;
+        uint64_t best_d = 0;
+        for (auto& x : delta)
+            if (x.first > best_d && x.first <= target && !x.second->migrating()) {
+                best = x.second;
+                best_d = x.first;
+            }
+        if (!best)
+            return;
+        // counted before stopping_ is checked, so that a stopping
+        // thread either sees the token or we see stopping_
+        std::shared_ptr<move_token> token(new move_token(nmoving_));
+        if (stopping_)
+            return;
+        async_rpc_server<T>* to = cold->server;
+        if (best->migrate(cold->loop, [to, token](async_rpcc<T>* c) { to->adopt(c); })) {
+            cold->load += best_d;
+            ++nmigrated_;
+        }
+    }
 };
 
 template <typename T>
@@ -95,10 +635,16 @@ struct threaded_rpc_server {
         listener_ = rpc::common::sock_helper::listen(port, 100);
         rpc::common::sock_helper::make_nodelay(listener_);
     }
+    // serves on the unix domain socket at path; use with unixnet
+    explicit threaded_rpc_server(const std::string& path) : path_(path) {
+        listener_ = rpc::common::sock_helper::listen_unix(path, 100);
+    }
 
     ~threaded_rpc_server() {
         if (listener_ >= 0)
 	    close(listener_);
+        if (!path_.empty())
+            unlink(path_.c_str());
     }
 
     void serve() {
@@ -129,11 +675,15 @@ struct threaded_rpc_server {
         rpc_header h;
         std::string body;
         while (true) {
-            if (!sm.hard_read((char*)&h, sizeof(h)))
+            if (!sm.hard_read((char*)&h, sizeof(h)) || !h.well_formed())
                 return;
             body.resize(h.payload_length());
             if (!sm.hard_read(&body[0], h.payload_length()))
                 return;
+            if (h.cancel())
+                continue;
+            if (h.has_budget())
+                strip_budget(h, body);
             auto s = sp_[h.proc()];
             mandatory_assert(s);
             s->dispatch_sync(h, body, &sm, rpc::common::tstamp());
@@ -144,6 +694,14 @@ struct threaded_rpc_server {
   private:
     std::vector<rpc_server_base<T>*> sp_; // service provider
     proc_counters<app_param::nproc, true> opcount_;
+    std::string path_;
+
+    // a thread per client has nothing to drop; serve it as a plain request
+    static void strip_budget(rpc_header& h, std::string& body) {
+        body.erase(0, h.ext_length());
+        h.set_mproc(rpc_header::make_mproc(h.proc(), 0));
+        h.set_payload_length(body.size(), true);
+    }
     int listener_;
 };
 
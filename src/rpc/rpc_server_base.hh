@@ -7,6 +7,7 @@
 namespace rpc {
 
 struct parser;
+struct grequest_base;
 template <typename T>
 struct async_rpcc;
 
@@ -18,6 +19,11 @@ struct rpc_server_base {
     virtual std::vector<int> proclist() const = 0;
     virtual void dispatch_sync(rpc_header&, std::string& body, srt_type*, uint64_t) = 0;
     virtual void dispatch(parser&, async_rpcc<T>*, uint64_t) = 0;
+    // calls from this process (see inproc.hh). The request is a
+    // grequest<proc, false>; false if the service can't take it.
+    virtual bool dispatch_local(grequest_base*, uint64_t) {
+        return false;
+    }
     virtual void client_failure(async_rpcc<T>*) = 0;
 };
 
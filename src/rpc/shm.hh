@@ -0,0 +1,420 @@
+#pragma once
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <ev++.h>
+
+#include "rpc/libev_loop.hh"
+#include "rpc_common/compiler.hh"
+#include "rpc_common/sock_helper.hh"
+#include "rpc_common/util.hh"
+
+// Shared memory provider for processes on the same host. Each
+// connection is a pair of single-producer single-consumer byte rings.
+// The connection is set up over a unix domain socket (see unix_tcpp and
+// async_rpc_server(path)), which then only serves to detect that the
+// peer went away.
+
+namespace rpc {
+
+struct shmnet;
+
+/** A byte ring in shared memory. The producer owns tail, the consumer
+    owns head; both only ever grow. Each side flags when it is about to
+    sleep, and the other side then kicks its eventfd. */
+struct shm_ring {
+    enum { capacity = 1 << 20 };
+    static size_t map_size() {
+	return sizeof(shm_ring) + capacity;
+    }
+    uint8_t* data() {
+	return reinterpret_cast<uint8_t*>(this + 1);
+    }
+    size_t readable() const {
+	return tail.load(std::memory_order_acquire) - head.load(std::memory_order_relaxed);
+    }
+    size_t writable() const {
+	return capacity - (tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire));
+    }
+
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint32_t> reader_waiting;
+    std::atomic<uint32_t> writer_waiting;
+};
+
+struct shm_conn {
+    virtual ~shm_conn() {
+	if (rx_)
+	    munmap(rx_, shm_ring::map_size());
+	if (tx_)
+	    munmap(tx_, shm_ring::map_size());
+	if (efd_ >= 0)
+	    ::close(efd_);
+	if (peer_efd_ >= 0)
+	    ::close(peer_efd_);
+	if (fd_ >= 0)
+	    ::close(fd_);
+    }
+
+    ssize_t read(void* buf, size_t len) {
+	size_t n;
+	while (!(n = rx_->readable())) {
+	    if (error_)
+		return 0;
+	    if (!blocking_) {
+		errno = EAGAIN;
+		return -1;
+	    }
+	    if (!spin(&shm_ring::readable, rx_, &shm_ring::reader_waiting))
+		wait();
+	}
+	n = std::min(n, len);
+	uint64_t h = rx_->head.load(std::memory_order_relaxed);
+	size_t off = h & (shm_ring::capacity - 1);
+	size_t first = std::min(n, shm_ring::capacity - off);
+	memcpy(buf, rx_->data() + off, first);
+	memcpy((uint8_t*)buf + first, rx_->data(), n - first);
+	rx_->head.store(h + n, std::memory_order_release);
+	kick(rx_->writer_waiting);
+	return n;
+    }
+    ssize_t write(const void* buf, size_t len) {
+	struct iovec iov;
+	iov.iov_base = const_cast<void*>(buf);
+	iov.iov_len = len;
+	return writev(&iov, 1);
+    }
+    ssize_t writev(const struct iovec* iov, int iovcnt) {
+	size_t room;
+	while (true) {
+	    if (error_) {
+		errno = EPIPE;
+		return -1;
+	    }
+	    if ((room = tx_->writable()))
+		break;
+	    if (!blocking_) {
+		// have the consumer kick us once it makes room
+		tx_->writer_waiting.store(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if ((room = tx_->writable()))
+		    break;
+		errno = EAGAIN;
+		return -1;
+	    }
+	    if (!spin(&shm_ring::writable, tx_, &shm_ring::writer_waiting))
+		wait();
+	}
+	uint64_t t = tx_->tail.load(std::memory_order_relaxed);
+	size_t w = 0;
+	for (int i = 0; i < iovcnt && w < room; ++i) {
+	    size_t n = std::min(iov[i].iov_len, room - w);
+	    size_t off = (t + w) & (shm_ring::capacity - 1);
+	    size_t first = std::min(n, shm_ring::capacity - off);
+	    memcpy(tx_->data() + off, iov[i].iov_base, first);
+	    memcpy(tx_->data(), (const uint8_t*)iov[i].iov_base + first, n - first);
+	    w += n;
+	}
+	tx_->tail.store(t + w, std::memory_order_release);
+	kick(tx_->reader_waiting);
+	return w;
+    }
+    void shutdown() {
+	if (fd_ >= 0)
+	    ::shutdown(fd_, SHUT_RDWR);
+    }
+
+    /** Exchange rings over the unix domain socket fd. Each side creates
+	the ring it reads from and the eventfd it sleeps on, and passes
+	both to the peer. */
+    int connect(int fd) {
+	assert(fd >= 0);
+	fd_ = fd;
+	int mfd = memfd_create("fastrpc-shm", MFD_CLOEXEC);
+	if (mfd < 0 || ftruncate(mfd, shm_ring::map_size()) != 0) {
+	    perror("memfd");
+	    if (mfd >= 0)
+		::close(mfd);
+	    return -1;
+	}
+	rx_ = map(mfd);
+	efd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	hello h = {hello_magic, uint32_t(shm_ring::map_size())};
+	int fds[2] = {mfd, efd_};
+	bool ok = rx_ && efd_ >= 0 && send_fds(&h, fds);
+	::close(mfd);
+	if (!ok) {
+	    perror("shm_conn: send");
+	    return -1;
+	}
+	if (!recv_fds(&h, fds)) {
+	    perror("shm_conn: recv");
+	    return -1;
+	}
+	peer_efd_ = fds[1];
+	struct stat st;
+	if (h.magic == hello_magic && h.size == shm_ring::map_size()
+	    && fstat(fds[0], &st) == 0 && size_t(st.st_size) == shm_ring::map_size())
+	    tx_ = map(fds[0]);
+	::close(fds[0]);
+	if (!tx_) {
+	    fprintf(stderr, "shm_conn: bad peer ring\n");
+	    return -1;
+	}
+	return 0;
+    }
+
+    // Blocking connections spin for up to this many microseconds before
+    // going to sleep; async ones spin with their loop, see
+    // nn_loop::set_busy_poll. Pass a negative value to query.
+    static int spin_time(int microseconds) {
+	static int nspin = 0;
+	if (microseconds >= 0)
+	    nspin = microseconds;
+	return nspin;
+    }
+
+  protected:
+    shm_conn(bool blocking)
+	: blocking_(blocking), error_(false), fd_(-1), efd_(-1), peer_efd_(-1),
+	  rx_(NULL), tx_(NULL) {
+    }
+
+    // Wait for f to become non-zero, spinning first. Returns true if
+    // it did; otherwise `flag` is raised, and the peer will kick efd_.
+    bool spin(size_t (shm_ring::*f)() const, shm_ring* r, std::atomic<uint32_t> shm_ring::*flag) {
+	if (int us = spin_time(-1)) {
+	    double deadline = rpc::common::now() + us / 1e6;
+	    do {
+		for (int i = 0; i < 64; ++i)
+		    if ((r->*f)())
+			return true;
+	    } while (rpc::common::now() < deadline);
+	}
+	(r->*flag).store(1);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	return (r->*f)();
+    }
+    // after publishing, wake up the peer if it is going to sleep
+    void kick(std::atomic<uint32_t>& waiting) {
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (waiting.load(std::memory_order_relaxed) && waiting.exchange(0)) {
+	    uint64_t one = 1;
+	    // if the peer is gone, the socket will tell
+	    ssize_t r = ::write(peer_efd_, &one, sizeof(one));
+	    (void) r;
+	}
+    }
+    // blocking connections sleep here; EOF on the socket means the
+    // peer went away
+    void wait() {
+	struct pollfd pfd[2];
+	pfd[0].fd = efd_;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = fd_;
+	pfd[1].events = POLLIN;
+	if (::poll(pfd, 2, -1) > 0) {
+	    if (pfd[1].revents)
+		error_ = true;
+	    clear_eventfd();
+	}
+    }
+    void clear_eventfd() {
+	uint64_t v;
+	// fails with EAGAIN if nothing is pending
+	ssize_t r = ::read(efd_, &v, sizeof(v));
+	(void) r;
+    }
+
+    bool blocking_;
+    std::atomic<bool> error_;
+    int fd_;    // unix domain socket to the peer
+    int efd_;   // we sleep on this one
+    int peer_efd_;
+    shm_ring* rx_;
+    shm_ring* tx_;
+
+  private:
+    enum { hello_magic = 0x73686d31 };
+    struct hello {
+	uint32_t magic;
+	uint32_t size;
+    };
+    static shm_ring* map(int fd) {
+	void* p = mmap(NULL, shm_ring::map_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	return p == MAP_FAILED ? NULL : reinterpret_cast<shm_ring*>(p);
+    }
+    bool send_fds(hello* h, int* fds) {
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	struct iovec iov = {h, sizeof(*h)};
+	struct msghdr msg;
+	bzero(&msg, sizeof(msg));
+	bzero(control, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(2 * sizeof(int));
+	memcpy(CMSG_DATA(cm), fds, 2 * sizeof(int));
+	return ::sendmsg(fd_, &msg, MSG_NOSIGNAL) == sizeof(*h);
+    }
+    bool recv_fds(hello* h, int* fds) {
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	struct iovec iov = {h, sizeof(*h)};
+	struct msghdr msg;
+	bzero(&msg, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (::recvmsg(fd_, &msg, MSG_CMSG_CLOEXEC) != sizeof(*h))
+	    return false;
+	struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+	if (!cm || cm->cmsg_type != SCM_RIGHTS || cm->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+	    errno = EPROTO;
+	    return false;
+	}
+	memcpy(fds, CMSG_DATA(cm), 2 * sizeof(int));
+	return true;
+    }
+};
+
+struct shm_sync_conn : public shm_conn {
+  protected:
+    friend class shmnet;
+    shm_sync_conn() : shm_conn(true) {
+    }
+};
+
+/** Rings are edge triggered from the loop's point of view: drain()
+    dispatches whatever is ready, and prepare_sleep() has the peer kick
+    the eventfd before the loop sleeps on it. A loop that busy polls
+    drains all its rings in each pass. */
+struct shm_async_conn : public shm_conn, public edge_triggered_channel {
+    typedef std::function<bool(shm_async_conn*, int)> callback_type;
+
+    ~shm_async_conn() {
+	if (registered_) {
+	    nn_loop::get_tls_loop()->remove_edge_triggered(this);
+	    ew_.stop();
+	    obw_.stop();
+	}
+    }
+    bool drain() {
+	bool dispatched = false;
+	bool deleted = false;
+	while (!deleted) {
+	    int interest = ready_flags() & flags_;
+	    if (!interest)
+		break;
+	    dispatched = true;
+	    deleted = cb_(this, interest);
+	}
+	if (!deleted && error_ && flags_) {
+	    cb_(this, ev::READ);
+	    dispatched = true;
+	}
+	return dispatched;
+    }
+    bool prepare_sleep() {
+	if (flags_ & ev::READ)
+	    rx_->reader_waiting.store(1);
+	if (flags_ & ev::WRITE)
+	    tx_->writer_waiting.store(1);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	return flags_ && ((ready_flags() & flags_) || error_);
+    }
+    void register_callback(callback_type cb, int flags) {
+	nn_loop* loop = nn_loop::get_tls_loop();
+	loop->add_edge_triggered(this);
+	registered_ = true;
+	cb_ = cb;
+	ew_.set(loop->ev_loop());
+	ew_.set<shm_async_conn, &shm_async_conn::wakeup>(this);
+	ew_.start(efd_, ev::READ);
+	rpc::common::sock_helper::make_nonblock(fd_);
+	obw_.set(loop->ev_loop());
+	obw_.set<shm_async_conn, &shm_async_conn::close>(this);
+	obw_.start(fd_, ev::READ);
+	eselect(flags);
+    }
+    void eselect(int flags) {
+	flags_ = flags;
+    }
+    int ev_flags() const {
+	return flags_;
+    }
+    int ready_flags() const {
+	int flags = 0;
+	if (rx_->readable())
+	    flags |= ev::READ;
+	if (tx_->writable())
+	    flags |= ev::WRITE;
+	return flags;
+    }
+
+  protected:
+    friend class shmnet;
+    shm_async_conn() : shm_conn(false), flags_(0), registered_(false) {
+    }
+
+  private:
+    // the next run_once() drains us
+    void wakeup(ev::io&, int) {
+	clear_eventfd();
+    }
+    void close(ev::io&, int) {
+	error_ = true;
+	obw_.stop();
+    }
+
+    int flags_;
+    bool registered_;
+    callback_type cb_;
+    ev::io ew_;  // eventfd watcher
+    ev::io obw_; // out-of-band socket watcher
+};
+
+struct shmnet {
+    typedef shm_sync_conn sync_transport;
+    typedef shm_async_conn async_transport;
+    // see has_handshake
+    static const bool handshake = true;
+    template <typename T>
+    static T* make(int fd) {
+	T* c = new T();
+	if (!c) {
+	    close(fd);
+	    return NULL;
+	}
+	if (c->connect(fd) == 0)
+	    return c;
+	delete c; // closes fd
+	return NULL;
+    }
+    static sync_transport* make_sync(int fd) {
+	return make<sync_transport>(fd);
+    }
+    static async_transport* make_async(int fd) {
+	return make<async_transport>(fd);
+    }
+    // how long blocking connections spin on an empty (or full) ring
+    // before sleeping; pair with nn_loop::set_busy_poll for async ones
+    static void set_poll_interval(int microseconds) {
+	shm_conn::spin_time(microseconds);
+    }
+};
+
+}
@@ -160,6 +160,12 @@ struct sync_rpc_transport : public spinlock {
 	    delete p_;
 	p_ = new multi_tcpp(h.c_str(), local.c_str(), port);
     }
+    // connect to a unix domain socket instead
+    void set_path(const std::string& path) {
+	if (p_)
+	    delete p_;
+	p_ = new unix_tcpp(path.c_str());
+    }
     bool connect() {
         if (conn_ == NULL) {
 	    int fd = p_->connect();
@@ -250,6 +256,10 @@ struct sync_rpc_transport : public spinlock {
 	    flush();
 	return ok;
     }
+    // threaded_rpc_server ignores cancel frames
+    bool cancelled(uint32_t /*seq*/) const {
+	return false;
+    }
     template <typename PROC, typename M, typename REPLY>
     bool sync_call(uint32_t seq, PROC proc, const M& req, REPLY& r) {
 	if (!connected())
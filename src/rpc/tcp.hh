@@ -1,5 +1,10 @@
 #pragma once
 #include <functional>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
 #include <ev++.h>
 #include "rpc_common/sock_helper.hh"
 #include "rpc_util/tcpfds.hh"
@@ -7,6 +12,8 @@
 namespace rpc {
 
 struct tcpnet;
+struct uringnet;
+struct udpnet;
 
 struct socket_wrapper {
     ~socket_wrapper() {
@@ -18,11 +25,16 @@ struct socket_wrapper {
     ssize_t write(const void* buffer, size_t len) {
 	return ::write(fd_, buffer, len);
     }
+    ssize_t writev(const struct iovec* iov, int iovcnt) {
+	return ::writev(fd_, iov, iovcnt);
+    }
     void shutdown() {
 	::shutdown(fd_, SHUT_RDWR);
     }
   protected:
     friend class tcpnet;
+    friend class uringnet;
+    friend class udpnet;
     socket_wrapper(int fd) : fd_(fd) {
         rpc::common::sock_helper::make_nodelay(fd_);
 	assert(fd >= 0);
@@ -46,16 +58,110 @@ struct async_tcp : public socket_wrapper {
 	if (flags != ev_flags_)
 	    hard_eselect(flags);
     }
+    // see can_migrate; register_callback binds to the new loop
+    void detach() {
+	eselect(0);
+    }
     int ev_flags() const {
 	return ev_flags_;
     }
+    ssize_t write(const void* buffer, size_t len) {
+	return again_if_connecting(::write(fd_, buffer, len));
+    }
+    ssize_t writev(const struct iovec* iov, int iovcnt) {
+	return again_if_connecting(::writev(fd_, iov, iovcnt));
+    }
+
+    // Outbufs with at least zerocopy_threshold() bytes to send should go
+    // through writev_zerocopy; 0 if zero-copy sends are off.
+    uint32_t zerocopy_threshold() const {
+	return zc_ ? zerocopy() : 0;
+    }
+    // Each successful call is numbered, starting from 0. The memory it
+    // sent must stay untouched until reap_zerocopy has reported its number.
+    ssize_t writev_zerocopy(const struct iovec* iov, int iovcnt) {
+#ifdef MSG_ZEROCOPY
+	struct msghdr msg;
+	bzero(&msg, sizeof(msg));
+	msg.msg_iov = const_cast<struct iovec*>(iov);
+	msg.msg_iovlen = iovcnt;
+	return again_if_connecting(::sendmsg(fd_, &msg, MSG_ZEROCOPY));
+#else
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+    }
+    // Read one completion from the error queue: sends [lo, hi] are done.
+    bool reap_zerocopy(uint32_t& lo, uint32_t& hi) {
+#if defined(MSG_ZEROCOPY) && defined(__linux__)
+	char control[128];
+	struct msghdr msg;
+	bzero(&msg, sizeof(msg));
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	while (::recvmsg(fd_, &msg, MSG_ERRQUEUE) != -1) {
+	    for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+		struct sock_extended_err* e = (struct sock_extended_err*) CMSG_DATA(cm);
+		if (e->ee_errno != 0 || e->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+		    continue;
+		// the kernel had to copy (e.g. loopback): stop paying for
+		// the notifications
+		if (e->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+		    zc_ = false;
+		lo = e->ee_info;
+		hi = e->ee_data;
+		return true;
+	    }
+	    msg.msg_controllen = sizeof(control);
+	}
+#endif
+	return false;
+    }
+    // Sockets created from now on send outbufs of at least @a threshold
+    // bytes with MSG_ZEROCOPY. 0 disables; pass a negative value to query.
+    static uint32_t zerocopy(int64_t threshold = -1) {
+	static uint32_t zc = 0;
+	if (threshold >= 0)
+	    zc = threshold;
+	return zc;
+    }
+    // Sockets created from now on ask the driver to busy poll for
+    // up to @a us microseconds (SO_BUSY_POLL). Pass a negative value
+    // to query.
+    static int busy_poll(int us = -1) {
+	static int bp = 0;
+	if (us >= 0)
+	    bp = us;
+	return bp;
+    }
   protected:
     friend class tcpnet;
-    async_tcp(int fd) : socket_wrapper(fd), ev_flags_(0) {
+    async_tcp(int fd) : socket_wrapper(fd), ev_flags_(0), zc_(false) {
         rpc::common::sock_helper::make_nonblock(fd_);
+	int one = 1;
+	(void) one;
+#ifdef SO_ZEROCOPY
+	zc_ = zerocopy() && setsockopt(fd_, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+#endif
+#ifdef SO_BUSY_POLL
+	// best effort: raising it above net.core.busy_read needs CAP_NET_ADMIN
+	if (int us = busy_poll()) {
+	    setsockopt(fd_, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us));
+#ifdef SO_PREFER_BUSY_POLL
+	    setsockopt(fd_, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one));
+#endif
+	}
+#endif
     }
 
   private:
+    // A fast open socket that has no cookie for the server yet keeps
+    // the data until the handshake is done.
+    static ssize_t again_if_connecting(ssize_t r) {
+	if (r == -1 && errno == EINPROGRESS)
+	    errno = EAGAIN;
+	return r;
+    }
     void event_handler(ev::io&, int e) {
         int flags = e & ev_flags_;
         if (flags)
@@ -71,6 +177,7 @@ struct async_tcp : public socket_wrapper {
     event_handler_type cb_;
     ev::io ev_;
     int ev_flags_;
+    bool zc_;
 };
 
 struct tcpnet {
@@ -79,6 +186,12 @@ struct tcpnet {
 
     typedef socket_wrapper sync_transport;
     typedef async_tcp async_transport;
+    // see has_async_connect
+    static const bool async_connect = true;
+    // see can_migrate
+    static const bool migratable = true;
+    // see has_zerocopy
+    static const bool zerocopy = true;
     template <typename T>
     static T* make(int fd) {
 	T* c = new T(fd);
@@ -92,9 +205,19 @@ struct tcpnet {
     static async_transport* make_async(int fd) {
 	return make<async_transport>(fd);
     }
-    static void set_poll_interval(int) {
-	// nothing to do. We don't use TCP in polling mode
+    // see async_tcp::busy_poll; pair with nn_loop::set_busy_poll
+    static void set_poll_interval(int microseconds) {
+	async_tcp::busy_poll(microseconds);
     }
+    // see async_tcp::zerocopy
+    static void set_zerocopy(uint32_t threshold) {
+	async_tcp::zerocopy(threshold);
+    }
+};
+
+// AF_UNIX stream sockets, for clients on the same host. To the
+// transports they look just like TCP sockets.
+struct unixnet : public tcpnet {
 };
 
 }
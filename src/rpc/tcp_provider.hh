@@ -1,25 +1,156 @@
 #pragma once
 #include <string>
+#include <stdint.h>
+#include <type_traits>
+#include <functional>
 #include "rpc_common/sock_helper.hh"
+#include "rpc/resolver.hh"
 
 namespace rpc {
 
+// Whether the transports of provider T can be made from a socket that
+// is still connecting (T::async_connect). Those that exchange setup
+// messages over the socket first (ibnet, shmnet) cannot.
+template <typename T>
+struct has_async_connect {
+    template <typename C>
+    static typename std::enable_if<C::async_connect, uint8_t>::type test(int);
+    template <typename>
+    static uint32_t test(...);
+    static const bool value = (sizeof(test<T>(0)) == 1);
+};
+
+// Whether a connection of provider T can move to the loop of another
+// thread (T::migratable): its async transport then has detach(), and
+// register_callback() again on the new thread resumes it. Those tied
+// to per-thread state (ibnet, shmnet, uringnet, udpnet) cannot.
+template <typename T>
+struct can_migrate {
+    template <typename C>
+    static typename std::enable_if<C::migratable, uint8_t>::type test(int);
+    template <typename>
+    static uint32_t test(...);
+    static const bool value = (sizeof(test<T>(0)) == 1);
+};
+
+// Whether the transports of provider T are set up by messages the two
+// sides exchange over the socket, client first (T::handshake).
+// async_rpc_server makes the transport of such a connection only once
+// the client's message has arrived.
+template <typename T>
+struct has_handshake {
+    template <typename C>
+    static typename std::enable_if<C::handshake, uint8_t>::type test(int);
+    template <typename>
+    static uint32_t test(...);
+    static const bool value = (sizeof(test<T>(0)) == 1);
+};
+
+// Whether the async transports of provider T keep state for each
+// request, such as where its reply goes or a copy to send again
+// (T::request_state). A request that gets no reply, or a call given up
+// on, is then handed to the transport's drop(seq), which releases that
+// state.
+template <typename T>
+struct has_request_state {
+    template <typename C>
+    static typename std::enable_if<C::request_state, uint8_t>::type test(int);
+    template <typename>
+    static uint32_t test(...);
+    static const bool value = (sizeof(test<T>(0)) == 1);
+};
+
+// Whether the async transports of provider T can send without copying
+// (T::zerocopy): they then have zerocopy_threshold(), writev_zerocopy()
+// and reap_zerocopy(). Those that copy every write anyway (ibnet, shmnet,
+// uringnet, udpnet, emunet) do not.
+template <typename T>
+struct has_zerocopy {
+    template <typename C>
+    static typename std::enable_if<C::zerocopy, uint8_t>::type test(int);
+    template <typename>
+    static uint32_t test(...);
+    static const bool value = (sizeof(test<T>(0)) == 1);
+};
+
 struct tcp_provider {
     virtual int connect() = 0;
+    // Like connect, but may return before the connection is established,
+    // in which case @a in_progress is set.
+    virtual int connect_nonblock(bool& in_progress) {
+	in_progress = false;
+	return connect();
+    }
+    // False if connecting would block first, e.g. to resolve a host
+    // name; @a cb is then called on this thread's nn_loop once it would
+    // not.
+    virtual bool ready(std::function<void()> cb) {
+	return true;
+    }
     virtual ~tcp_provider() {}
 };
 
+// Each attempt connects to the next address of the remote host, as
+// cached by the resolver.
 struct multi_tcpp : public tcp_provider {
     multi_tcpp(const char* remote, const char* local, int remote_port)
-	: rmt_(remote), local_(local), rmtport_(remote_port) {
+	: rmt_(remote), local_(local), rmtport_(remote_port), next_(0) {
     }
     int connect() {
-	return rpc::common::sock_helper::connect(rmt_.c_str(), rmtport_, local_.c_str(), 0);
+	rpc::common::endpoint e;
+	if (!next(e))
+	    return -1;
+	return rpc::common::sock_helper::connect(e, local_.c_str(), 0);
+    }
+    int connect_nonblock(bool& in_progress) {
+	rpc::common::endpoint e;
+	if (!next(e))
+	    return -1;
+	return rpc::common::sock_helper::connect_nonblock(e, local_.c_str(), 0, in_progress);
+    }
+    bool ready(std::function<void()> cb) {
+	if (resolver::get().cached(rmt_))
+	    return true;
+	resolver::get().resolve(rmt_, rmtport_, [cb](const resolver::addrs_type&) { cb(); });
+	return false;
     }
   private:
     std::string rmt_;
     std::string local_;
     int rmtport_;
+    unsigned next_;
+
+    bool next(rpc::common::endpoint& e) {
+	resolver::addrs_type a;
+	if (!resolver::get().lookup(rmt_, rmtport_, a))
+	    return false;
+	e = a[next_++ % a.size()];
+	return true;
+    }
+};
+
+// connects to a unix domain socket
+struct unix_tcpp : public tcp_provider {
+    unix_tcpp(const char* path) : path_(path) {
+    }
+    int connect() {
+	return rpc::common::sock_helper::connect_unix(path_.c_str());
+    }
+  private:
+    std::string path_;
+};
+
+// a connected UDP socket, for udpnet
+struct udp_tcpp : public tcp_provider {
+    udp_tcpp(const char* remote, int remote_port)
+	: rmt_(remote), rmtport_(remote_port) {
+    }
+    int connect() {
+	return rpc::common::sock_helper::connect_udp(rmt_.c_str(), rmtport_);
+    }
+  private:
+    std::string rmt_;
+    int rmtport_;
 };
 
 struct onetime_tcpp : public tcp_provider {
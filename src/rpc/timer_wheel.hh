@@ -0,0 +1,159 @@
+#pragma once
+
+#include "rpc_common/compiler.hh"
+#include "rpc_common/util.hh"
+#include <ev++.h>
+#include <stdint.h>
+#include <algorithm>
+
+namespace rpc {
+
+struct wheel_node {
+    wheel_node() : prev_(NULL), next_(NULL) {
+    }
+    wheel_node* prev_;
+    wheel_node* next_;
+};
+
+/** Something that happens at a point in time, see timer_wheel */
+struct wheel_timer : public wheel_node {
+    wheel_timer() : due_(0) {
+    }
+    virtual ~wheel_timer() {
+    }
+    // called by the wheel, which no longer holds the timer
+    virtual void expire() = 0;
+    bool scheduled() const {
+	return prev_ != NULL;
+    }
+  private:
+    uint64_t due_;  // in ticks
+    friend struct timer_wheel;
+};
+
+/** @brief Hierarchical timing wheel of an nn_loop. Scheduling and
+    canceling a timer are O(1), however many there are. Level i has
+    nslots slots of nslots^i ticks each; a timer moves down a level each
+    time the level below wraps around, and one due beyond the top level
+    waits there. A single libev timer, armed only while the wheel holds
+    timers, wakes the loop at the next occupied slot or wrap. */
+struct timer_wheel {
+    enum { slot_bits = 6, nslots = 1 << slot_bits, nlevels = 4 };
+
+    timer_wheel(ev::loop_ref loop)
+	: now_(0), armed_(0), size_(0), ev_(loop) {
+	for (int l = 0; l < nlevels; ++l)
+	    for (int s = 0; s < nslots; ++s)
+		slots_[l][s].prev_ = slots_[l][s].next_ = &slots_[l][s];
+	ev_.set<timer_wheel, &timer_wheel::fire>(this);
+    }
+    ~timer_wheel() {
+	ev_.stop();
+    }
+    // Expire @a t no earlier than @a at, a rpc::common::tstamp(), and
+    // within a tick after it.
+    void schedule(wheel_timer* t, uint64_t at) {
+	mandatory_assert(!t->scheduled());
+	uint64_t now = rpc::common::tstamp() / tick_us();
+	if (!size_)
+	    now_ = now;
+	// round up: the tick holding @a at starts before it
+	uint64_t due = (at + tick_us() - 1) / tick_us();
+	t->due_ = std::max(due, now_);
+	insert(t);
+	++size_;
+	if (!ev_.is_active() || t->due_ < armed_)
+	    arm(now);
+    }
+    void cancel(wheel_timer* t) {
+	if (!t->scheduled())
+	    return;
+	unlink(t);
+	if (--size_ == 0)
+	    ev_.stop();
+    }
+    size_t size() const {
+	return size_;
+    }
+    // Microseconds per tick; pass a positive value to set it for wheels
+    // made from now on.
+    static uint64_t tick_us(int64_t us = -1) {
+	static uint64_t tick = 1000;
+	if (us > 0)
+	    tick = us;
+	return tick;
+    }
+
+  private:
+    wheel_node slots_[nlevels][nslots];
+    uint64_t now_;    // the first tick not yet processed
+    uint64_t armed_;  // ev_ fires at this tick
+    size_t size_;
+    ev::timer ev_;
+
+    static int index(uint64_t tick, int level) {
+	return (tick >> (slot_bits * level)) & (nslots - 1);
+    }
+    void insert(wheel_timer* t) {
+	uint64_t delta = t->due_ - now_;
+	int l = 0;
+	while (l < nlevels - 1 && delta >= (uint64_t(1) << (slot_bits * (l + 1))))
+	    ++l;
+	uint64_t at = t->due_;
+	// beyond the top level: wait in its last slot, and look again then
+	if (delta >> (slot_bits * nlevels))
+	    at = now_ + (uint64_t(1) << (slot_bits * nlevels)) - 1;
+	wheel_node* h = &slots_[l][index(at, l)];
+	t->prev_ = h->prev_;
+	t->next_ = h;
+	h->prev_->next_ = t;
+	h->prev_ = t;
+    }
+    static void unlink(wheel_node* t) {
+	t->prev_->next_ = t->next_;
+	t->next_->prev_ = t->prev_;
+	t->prev_ = t->next_ = NULL;
+    }
+    // the next tick that has timers or cascades
+    uint64_t next_tick() const {
+	for (uint64_t t = now_; ; ++t) {
+	    const wheel_node* h = &slots_[0][index(t, 0)];
+	    if (h->next_ != h || index(t, 0) == 0)
+		return t;
+	}
+    }
+    void arm(uint64_t now) {
+	armed_ = next_tick();
+	ev_.stop();
+	ev_.start(armed_ > now ? double(armed_ - now) * tick_us() / 1000000 : 0.);
+    }
+    void fire(ev::timer&, int) {
+	uint64_t now = rpc::common::tstamp() / tick_us();
+	while (now_ <= now && size_) {
+	    // entering a new round of level l-1: spread slot now_ of level l
+	    for (int l = 1; l < nlevels && index(now_, l - 1) == 0; ++l) {
+		wheel_node* h = &slots_[l][index(now_, l)];
+		while (h->next_ != h) {
+		    wheel_timer* t = static_cast<wheel_timer*>(h->next_);
+		    unlink(t);
+		    insert(t);
+		}
+	    }
+	    wheel_node* h = &slots_[0][index(now_, 0)];
+	    ++now_;
+	    // expire() may schedule or cancel any timer
+	    while (h->next_ != h) {
+		wheel_timer* t = static_cast<wheel_timer*>(h->next_);
+		unlink(t);
+		--size_;
+		t->expire();
+	    }
+	}
+	if (size_)
+	    arm(now);
+	else
+	    ev_.stop();
+    }
+};
+
+}
@@ -0,0 +1,586 @@
+#pragma once
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <algorithm>
+#include <ev++.h>
+
+#include "rpc/libev_loop.hh"
+#include "rpc/rpc_parser.hh"
+#include "rpc/tcp.hh"
+#include "rpc_common/compiler.hh"
+#include "rpc_common/sock_helper.hh"
+#include "rpc_common/util.hh"
+
+// Datagram provider for small RPCs. Every rpc_header frame travels in
+// a UDP datagram of its own; the frames a loop iteration produces go
+// out in one sendmmsg, and incoming datagrams are read in batches with
+// recvmmsg.
+//
+// The client (udp_tcpp) keeps a copy of each request until its reply
+// arrives and sends it again after timeout() milliseconds, up to
+// retries() times, after which the connection fails. A request may
+// thus run more than once on the server, and only its first reply is
+// delivered. Frames larger than max_datagram() go over a TCP connection
+// to the same address, opened (blocking) the first time one is needed.
+// A reply that is too large for a datagram is replaced by a notice,
+// upon which the client sends the request again over TCP.
+//
+// On the server one socket (sock_helper::bind_udp, handed to
+// async_rpc_server::register_rpcc) serves all peers: sequence numbers
+// are rewritten on the way in so that the peer of a reply can be found,
+// and nothing is kept about a peer between its requests. TCP fallback
+// connections are accepted by the async_rpc_server itself.
+
+namespace rpc {
+
+struct udpnet;
+
+struct async_udp {
+    typedef std::function<bool(async_udp*, int)> event_handler_type;
+
+    ~async_udp() {
+	rw_.stop();
+	tw_.stop();
+	timer_.stop();
+	::close(fd_);
+	if (tcp_ >= 0)
+	    ::close(tcp_);
+	for (auto& p : pending_)
+	    delete p.second;
+    }
+    ssize_t read(void* buffer, size_t len) {
+	if (mode_ == stream)
+	    return ::read(fd_, buffer, len);
+	while (rhead_ == rbuf_.size()) {
+	    rbuf_.clear();
+	    rhead_ = 0;
+	    if (failed_) {
+		errno = failed_;
+		return -1;
+	    }
+	    if (!receive()) {
+		errno = EAGAIN;
+		return -1;
+	    }
+	}
+	size_t n = std::min(len, rbuf_.size() - rhead_);
+	memcpy(buffer, &rbuf_[rhead_], n);
+	rhead_ += n;
+	return n;
+    }
+    ssize_t write(const void* buffer, size_t len) {
+	struct iovec iov = {const_cast<void*>(buffer), len};
+	return writev(&iov, 1);
+    }
+    // takes everything: a datagram is either sent now or lost
+    ssize_t writev(const struct iovec* iov, int iovcnt) {
+	if (mode_ == stream)
+	    return ::writev(fd_, iov, iovcnt);
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+	    const char* p = reinterpret_cast<const char*>(iov[i].iov_base);
+	    size_t n = iov[i].iov_len;
+	    total += n;
+	    while (n) {
+		if (partial_.empty() && n >= sizeof(rpc_header) && n >= frame_length(p)) {
+		    size_t l = frame_length(p);
+		    send_frame(p, l);
+		    p += l;
+		    n -= l;
+		    continue;
+		}
+		// a frame split across buffers
+		size_t need = sizeof(rpc_header);
+		if (partial_.size() >= need)
+		    need = frame_length(partial_.data());
+		size_t k = std::min(need - partial_.size(), n);
+		partial_.append(p, k);
+		p += k;
+		n -= k;
+		if (partial_.size() >= sizeof(rpc_header)
+		    && partial_.size() == frame_length(partial_.data())) {
+		    send_frame(partial_.data(), partial_.size());
+		    partial_.clear();
+		}
+	    }
+	}
+	send_batch();
+	if (failed_) {
+	    errno = failed_;
+	    return -1;
+	}
+	return total;
+    }
+    void shutdown() {
+	::shutdown(fd_, SHUT_RDWR);
+	if (tcp_ >= 0)
+	    ::shutdown(tcp_, SHUT_RDWR);
+    }
+    void register_callback(event_handler_type cb, int flags) {
+	nn_loop* loop = nn_loop::get_tls_loop();
+	cb_ = cb;
+	rw_.set(loop->ev_loop());
+	rw_.set<async_udp, &async_udp::event_handler>(this);
+	tw_.set(loop->ev_loop());
+	tw_.set<async_udp, &async_udp::event_handler>(this);
+	timer_.set(loop->ev_loop());
+	timer_.set<async_udp, &async_udp::retransmit>(this);
+	eselect(flags);
+    }
+    void eselect(int flags) {
+	if (flags == ev_flags_)
+	    return;
+	ev_flags_ = flags;
+	rw_.stop();
+	if (flags)
+	    rw_.start(fd_, flags);
+	select_tcp();
+    }
+    int ev_flags() const {
+	return ev_flags_;
+    }
+    // The request @a seq will get no reply: a server forgets where it
+    // came from, a client stops sending it again
+    void drop(uint32_t seq) {
+	if (mode_ == client) {
+	    auto it = pending_.find(seq);
+	    if (it != pending_.end()) {
+		delete it->second;
+		pending_.erase(it);
+		if (pending_.empty())
+		    timer_.stop();
+	    }
+	    return;
+	}
+	peer* x = &peer_[seq & peer_capmask_];
+	if (x->used && x->lseq == seq) {
+	    x->used = false;
+	    --npeer_;
+	}
+    }
+
+    // Largest frame sent as a datagram; the default fits an Ethernet
+    // MTU. Pass a negative value to query.
+    static uint32_t max_datagram(int size = -1) {
+	static uint32_t n = 1472;
+	if (size >= 0)
+	    n = std::max(size_t(size), sizeof(rpc_header));
+	return n;
+    }
+    // milliseconds before a request is sent again
+    static int timeout(int ms = -1) {
+	static int t = 20;
+	if (ms > 0)
+	    t = ms;
+	return t;
+    }
+    // times a request is sent again before the connection fails
+    static int retries(int n = -1) {
+	static int r = 5;
+	if (n >= 0)
+	    r = n;
+	return r;
+    }
+
+  protected:
+    friend struct udpnet;
+    async_udp(int fd)
+	: fd_(fd), tcp_(-1), ev_flags_(0), failed_(0), rhead_(0),
+	  lseq_(0), npeer_(0), peer_capmask_(15), peer_(new peer[16]) {
+	int type = 0;
+	socklen_t len = sizeof(type);
+	struct sockaddr_in sin;
+	socklen_t sinlen = sizeof(sin);
+	mandatory_assert(getsockopt(fd_, SOL_SOCKET, SO_TYPE, &type, &len) == 0);
+	if (type == SOCK_STREAM) {
+	    mode_ = stream;
+	    rpc::common::sock_helper::make_nodelay(fd_);
+	} else if (getpeername(fd_, (struct sockaddr*) &sin, &sinlen) == 0)
+	    mode_ = client;
+	else
+	    mode_ = server;
+	rpc::common::sock_helper::make_nonblock(fd_);
+	bzero(peer_, sizeof(peer) * 16);
+    }
+
+  private:
+    enum { batch = 32 };
+    enum mode_type { stream, client, server };
+    static const uint32_t toobig = 0xffffffff; // mproc of a notice
+
+    // a request waiting for its reply, on the client
+    struct request {
+	std::string frame; // empty once sent over TCP
+	uint64_t sent_at;
+	int tries;
+    };
+    // a request being served, on the server
+    struct peer {
+	struct sockaddr_in addr;
+	uint32_t seq;  // the peer's
+	uint32_t lseq; // ours
+	bool used;
+    };
+    struct datagram {
+	size_t off;
+	uint32_t len;
+	struct sockaddr_in addr;
+    };
+
+    static uint32_t frame_length(const char* p) {
+	const rpc_header* h = reinterpret_cast<const rpc_header*>(p);
+	return h->payload_length() + sizeof(rpc_header);
+    }
+    // @a h, if given, replaces the header of the frame at @a p
+    void queue(const char* p, size_t len, const struct sockaddr_in* addr,
+	       const rpc_header* h = NULL) {
+	datagram d;
+	d.off = obuf_.size();
+	d.len = len;
+	if (addr)
+	    d.addr = *addr;
+	if (h) {
+	    obuf_.append(reinterpret_cast<const char*>(h), sizeof(*h));
+	    obuf_.append(p + sizeof(*h), len - sizeof(*h));
+	} else
+	    obuf_.append(p, len);
+	out_.push_back(d);
+	if (out_.size() == batch)
+	    send_batch();
+    }
+    void send_batch() {
+	struct mmsghdr msgs[batch];
+	struct iovec iov[batch];
+	size_t n = out_.size();
+	bzero(msgs, sizeof(msgs[0]) * n);
+	for (size_t i = 0; i < n; ++i) {
+	    iov[i].iov_base = &obuf_[out_[i].off];
+	    iov[i].iov_len = out_[i].len;
+	    msgs[i].msg_hdr.msg_iov = &iov[i];
+	    msgs[i].msg_hdr.msg_iovlen = 1;
+	    if (mode_ == server) {
+		msgs[i].msg_hdr.msg_name = &out_[i].addr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(out_[i].addr);
+	    }
+	}
+	for (size_t i = 0; i < n; ) {
+	    int r = ::sendmmsg(fd_, msgs + i, n - i, 0);
+	    if (r > 0)
+		i += r;
+	    else if (r == -1 && errno == EINTR)
+		continue;
+	    else if (r == -1 && (errno == ECONNREFUSED || errno == EPERM) && mode_ == client)
+		++i; // ICMP from an earlier datagram; retries find out
+	    else
+		break; // the rest is lost, as it could be on the wire
+	}
+	obuf_.clear();
+	out_.clear();
+    }
+    void send_frame(const char* p, size_t len) {
+	const rpc_header* h = reinterpret_cast<const rpc_header*>(p);
+	if (mode_ == client) {
+	    mandatory_assert(h->request(), "udpnet clients don't serve requests");
+	    // the server is not told of cancelled calls, since it
+	    // renumbers requests; async_rpcc::cancel has dropped them
+	    if (h->cancel())
+		return;
+	    request* q = new request;
+	    q->tries = 0;
+	    q->sent_at = rpc::common::tstamp();
+	    auto r = pending_.insert(std::make_pair(h->seq_, q));
+	    if (!r.second) {
+		delete r.first->second;
+		r.first->second = q;
+	    }
+	    if (len > max_datagram()) {
+		send_tcp(p, len);
+		return;
+	    }
+	    q->frame.assign(p, len);
+	    queue(p, len, NULL);
+	    if (!timer_.is_active())
+		timer_.start(timeout() / 1000.0, timeout() / 1000.0);
+	    return;
+	}
+	mandatory_assert(!h->request());
+	peer* x = &peer_[h->seq_ & peer_capmask_];
+	if (!x->used || x->lseq != h->seq_)
+	    return;
+	x->used = false;
+	--npeer_;
+	rpc_header nh = *h;
+	nh.seq_ = x->seq;
+	if (len > max_datagram()) {
+	    nh.set_payload_length(0, false);
+	    nh.set_mproc(toobig);
+	    queue(reinterpret_cast<const char*>(&nh), sizeof(nh), &x->addr);
+	} else
+	    queue(p, len, &x->addr, &nh);
+    }
+
+    // the frames from the wire, in the order they become readable
+    bool receive() {
+	bool progress = false;
+	if (tcp_ >= 0)
+	    progress = receive_tcp();
+	struct mmsghdr msgs[batch];
+	struct iovec iov[batch];
+	struct sockaddr_in addr[batch];
+	size_t size = max_datagram();
+	if (ibuf_.size() != size * batch)
+	    ibuf_.resize(size * batch);
+	bzero(msgs, sizeof(msgs));
+	for (int i = 0; i < batch; ++i) {
+	    iov[i].iov_base = &ibuf_[size * i];
+	    iov[i].iov_len = size;
+	    msgs[i].msg_hdr.msg_iov = &iov[i];
+	    msgs[i].msg_hdr.msg_iovlen = 1;
+	    msgs[i].msg_hdr.msg_name = &addr[i];
+	    msgs[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+	}
+	int r;
+	while ((r = ::recvmmsg(fd_, msgs, batch, MSG_DONTWAIT, NULL)) == -1 && errno == EINTR)
+	    ;
+	for (int i = 0; i < r; ++i) {
+	    const char* p = reinterpret_cast<const char*>(iov[i].iov_base);
+	    uint32_t len = msgs[i].msg_len;
+	    // one bad datagram must not take down a socket all clients share
+	    if ((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) || len < sizeof(rpc_header)
+		|| !reinterpret_cast<const rpc_header*>(p)->well_formed()
+		|| len != frame_length(p))
+		continue;
+	    accept_frame(p, len, &addr[i]);
+	}
+	return progress || r > 0;
+    }
+    void accept_frame(const char* p, size_t len, const struct sockaddr_in* addr) {
+	const rpc_header* h = reinterpret_cast<const rpc_header*>(p);
+	if (mode_ == client) {
+	    auto it = pending_.find(h->seq_);
+	    if (h->request() || it == pending_.end())
+		return; // a late duplicate
+	    request* q = it->second;
+	    if (h->mproc() == toobig && len == sizeof(rpc_header)) {
+		if (!q->frame.empty()) {
+		    send_tcp(q->frame.data(), q->frame.size());
+		    std::string().swap(q->frame);
+		}
+		return;
+	    }
+	    delete q;
+	    pending_.erase(it);
+	    if (pending_.empty())
+		timer_.stop();
+	    rbuf_.append(p, len);
+	    return;
+	}
+	if (!h->request())
+	    return;
+	if (npeer_ == peer_capmask_ + 1 || peer_[lseq_ & peer_capmask_].used)
+	    expand_peer();
+	peer* x = &peer_[lseq_ & peer_capmask_];
+	x->addr = *addr;
+	x->seq = h->seq_;
+	x->lseq = lseq_;
+	x->used = true;
+	++npeer_;
+	size_t off = rbuf_.size();
+	rbuf_.append(p, len);
+	reinterpret_cast<rpc_header*>(&rbuf_[off])->seq_ = lseq_++;
+    }
+    void expand_peer() {
+	do {
+	    unsigned ncapmask = peer_capmask_ * 2 + 1;
+	    peer* np = new peer[ncapmask + 1];
+	    bzero(np, sizeof(peer) * (ncapmask + 1));
+	    for (unsigned i = 0; i <= peer_capmask_; ++i)
+		if (peer_[i].used)
+		    np[peer_[i].lseq & ncapmask] = peer_[i];
+	    delete[] peer_;
+	    peer_ = np;
+	    peer_capmask_ = ncapmask;
+	} while (peer_[lseq_ & peer_capmask_].used);
+    }
+
+    // TCP fallback, client side
+    void send_tcp(const char* p, size_t len) {
+	if (tcp_ < 0 && !connect_tcp()) {
+	    failed_ = errno ? errno : ECONNREFUSED;
+	    return;
+	}
+	tcp_out_.append(p, len);
+	flush_tcp();
+    }
+    bool connect_tcp() {
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	if (getpeername(fd_, (struct sockaddr*) &sin, &len) != 0)
+	    return false;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+	    return false;
+	if (::connect(fd, (struct sockaddr*) &sin, len) != 0) {
+	    int e = errno;
+	    ::close(fd);
+	    errno = e;
+	    return false;
+	}
+	rpc::common::sock_helper::make_nodelay(fd);
+	rpc::common::sock_helper::make_nonblock(fd);
+	tcp_ = fd;
+	select_tcp();
+	return true;
+    }
+    void flush_tcp() {
+	while (!tcp_out_.empty()) {
+	    ssize_t w = ::write(tcp_, tcp_out_.data(), tcp_out_.size());
+	    if (w > 0)
+		tcp_out_.erase(0, w);
+	    else if (w == -1 && errno == EINTR)
+		continue;
+	    else if (w == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		break;
+	    else {
+		failed_ = errno;
+		break;
+	    }
+	}
+	select_tcp();
+    }
+    bool receive_tcp() {
+	char buf[65536];
+	ssize_t r;
+	bool progress = false;
+	while ((r = ::read(tcp_, buf, sizeof(buf))) != 0) {
+	    if (r == -1 && errno == EINTR)
+		continue;
+	    if (r == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+		    failed_ = errno;
+		break;
+	    }
+	    progress = true;
+	    tcp_in_.append(buf, r);
+	}
+	if (r == 0)
+	    failed_ = ECONNRESET;
+	size_t off = 0;
+	while (tcp_in_.size() - off >= sizeof(rpc_header)) {
+	    if (!reinterpret_cast<const rpc_header*>(&tcp_in_[off])->well_formed()) {
+		failed_ = EPROTO;
+		break;
+	    }
+	    if (tcp_in_.size() - off < frame_length(&tcp_in_[off]))
+		break;
+	    size_t l = frame_length(&tcp_in_[off]);
+	    accept_frame(&tcp_in_[off], l, NULL);
+	    off += l;
+	}
+	tcp_in_.erase(0, off);
+	return progress || failed_;
+    }
+    void select_tcp() {
+	if (tcp_ < 0)
+	    return;
+	int flags = (ev_flags_ & ev::READ) | (tcp_out_.empty() ? 0 : ev::WRITE);
+	if (tw_.is_active() && tw_.events == flags)
+	    return;
+	tw_.stop();
+	if (flags)
+	    tw_.start(tcp_, flags);
+    }
+
+    void event_handler(ev::io& w, int e) {
+	if (&w == &tw_ && (e & ev::WRITE)) {
+	    flush_tcp();
+	    e &= ~ev::WRITE;
+	}
+	int flags = e & ev_flags_;
+	if (failed_)
+	    flags |= ev::READ;
+	if (flags)
+	    cb_(this, flags); // may delete this
+    }
+    void retransmit(ev::timer&, int) {
+	uint64_t now = rpc::common::tstamp();
+	uint64_t t = uint64_t(timeout()) * 1000;
+	for (auto& p : pending_) {
+	    request* q = p.second;
+	    if (q->frame.empty() || now - q->sent_at < t)
+		continue;
+	    if (++q->tries > retries()) {
+		failed_ = ETIMEDOUT;
+		break;
+	    }
+	    q->sent_at = now;
+	    queue(q->frame.data(), q->frame.size(), NULL);
+	}
+	send_batch();
+	if (failed_)
+	    cb_(this, ev::READ); // may delete this
+    }
+
+    int fd_;
+    int tcp_; // TCP fallback, client side
+    mode_type mode_;
+    int ev_flags_;
+    int failed_;
+    event_handler_type cb_;
+    ev::io rw_;
+    ev::io tw_;
+    ev::timer timer_;
+    std::vector<char> ibuf_; // for recvmmsg
+    std::string rbuf_; // received frames
+    size_t rhead_;
+    std::string partial_; // outgoing frame split across buffers
+    std::string obuf_;
+    std::vector<datagram> out_;
+    std::string tcp_in_;
+    std::string tcp_out_;
+    std::unordered_map<uint32_t, request*> pending_;
+    uint32_t lseq_;
+    unsigned npeer_;
+    unsigned peer_capmask_;
+    peer* peer_;
+};
+
+struct udpnet {
+    template <typename T>
+    using select_provider = epoll_tcpfds<T>;
+
+    // synchronous clients use the TCP fallback port
+    typedef socket_wrapper sync_transport;
+    typedef async_udp async_transport;
+    // see has_request_state
+    static const bool request_state = true;
+    template <typename T>
+    static T* make(int fd) {
+	T* c = new T(fd);
+	if (!c)
+	    close(fd);
+	return c;
+    }
+    static sync_transport* make_sync(int fd) {
+	return make<sync_transport>(fd);
+    }
+    static async_transport* make_async(int fd) {
+	return make<async_transport>(fd);
+    }
+    static void set_poll_interval(int) {
+	// nothing to do. We don't use UDP in polling mode
+    }
+    // see async_udp::max_datagram
+    static void set_max_datagram(uint32_t size) {
+	async_udp::max_datagram(size);
+    }
+};
+
+}
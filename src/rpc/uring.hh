@@ -0,0 +1,647 @@
+#pragma once
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <string.h>
+#include <functional>
+#include <algorithm>
+#include <string>
+#include <deque>
+#include <vector>
+#include <ev++.h>
+
+#include "rpc/libev_loop.hh"
+#include "rpc/tcp.hh"
+#include "rpc_common/compiler.hh"
+#include "rpc_common/sock_helper.hh"
+
+// io_uring based network provider. Needs Linux 6.0 or later for
+// multishot recv and provided buffer rings.
+
+namespace rpc {
+
+struct uring_loop;
+struct uring_sock;
+struct uring_conn;
+struct uringnet;
+
+// Anything with operations in flight on a uring_loop. The low two
+// bits of the user_data of a submission carry the operation type.
+// A retired target is deleted by the loop once its last operation
+// completes, so that the kernel never completes into freed memory.
+struct uring_target {
+    uring_target() : inflight_(0), retired_(false) {
+    }
+    virtual ~uring_target() {
+    }
+    virtual void complete(int op, int res, uint32_t flags) = 0;
+
+    int inflight_;
+    bool retired_;
+};
+
+/** @brief One io_uring per nn_loop. Submissions made while handling
+    events are batched and handed to the kernel once per loop iteration,
+    from drain(). Completions wake the loop through an eventfd. */
+struct uring_loop : public edge_triggered_channel {
+    enum { sq_entries = 1024, cq_entries = 4096 };
+    enum { nbuf = 1024, buf_size = 16384, bgid = 0 };
+
+    static uring_loop* get_tls_loop() {
+	static __thread uring_loop* tls_loop = NULL;
+	if (!tls_loop)
+	    tls_loop = new uring_loop(nn_loop::get_tls_loop());
+	return tls_loop;
+    }
+
+    io_uring_sqe* get_sqe() {
+	if (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_)
+	    submit();
+	mandatory_assert(sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) < sq_entries_,
+			 "submission queue is full");
+	io_uring_sqe* e = &sqes_[sqe_tail_ & sq_mask_];
+	++sqe_tail_;
+	bzero(e, sizeof(*e));
+	return e;
+    }
+    static uint64_t tag(uring_target* t, int op) {
+	assert(!(uintptr_t(t) & 3) && op < 4);
+	++t->inflight_;
+	return uintptr_t(t) | op;
+    }
+    void submit() {
+	__atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+	while (submitted_ != sqe_tail_) {
+	    int r = syscall(__NR_io_uring_enter, fd_, sqe_tail_ - submitted_, 0, 0, NULL, 0);
+	    if (r > 0)
+		submitted_ += r;
+	    else if (r < 0 && errno == EBUSY)
+		reap(); // completion queue overflowed
+	    else if (r < 0 && errno != EINTR && errno != EAGAIN) {
+		perror("io_uring_enter");
+		mandatory_assert(0 && "io_uring_enter failed");
+	    }
+	}
+    }
+
+    // provided buffers
+    uint8_t* buffer(uint16_t bid) const {
+	return bufs_ + size_t(bid) * buf_size;
+    }
+    void recycle(uint16_t bid) {
+	io_uring_buf& b = bring_[btail_ & (nbuf - 1)];
+	b.addr = uintptr_t(buffer(bid));
+	b.len = buf_size;
+	b.bid = bid;
+	++btail_;
+	// the ring tail overlays the resv field of the first entry
+	__atomic_store_n(&bring_[0].resv, btail_, __ATOMIC_RELEASE);
+	if (!starved_.empty())
+	    rearm_starved();
+    }
+    inline void add_starved(uring_sock* s);
+    inline void add_ready(uring_sock* s);
+    inline void remove_queued(uring_sock* s);
+
+    bool drain();
+
+  private:
+    uring_loop(nn_loop* loop) : sqe_tail_(0), submitted_(0), btail_(0) {
+	io_uring_params p;
+	bzero(&p, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = cq_entries;
+	CHECK((fd_ = syscall(__NR_io_uring_setup, sq_entries, &p)) >= 0);
+
+	size_t sqsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cqsz = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	    sqsz = cqsz = std::max(sqsz, cqsz);
+	uint8_t* sq = (uint8_t*)mmap(NULL, sqsz, PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+	CHECK(sq != MAP_FAILED);
+	uint8_t* cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+	    cq = (uint8_t*)mmap(NULL, cqsz, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+	    CHECK(cq != MAP_FAILED);
+	}
+	sqes_ = (io_uring_sqe*)mmap(NULL, p.sq_entries * sizeof(io_uring_sqe),
+				    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				    fd_, IORING_OFF_SQES);
+	CHECK(sqes_ != MAP_FAILED);
+	sq_head_ = (unsigned*)(sq + p.sq_off.head);
+	sq_tail_ = (unsigned*)(sq + p.sq_off.tail);
+	sq_flags_ = (unsigned*)(sq + p.sq_off.flags);
+	sq_mask_ = *(unsigned*)(sq + p.sq_off.ring_mask);
+	sq_entries_ = p.sq_entries;
+	// sqes_ is used in ring order
+	unsigned* sq_array = (unsigned*)(sq + p.sq_off.array);
+	for (unsigned i = 0; i < p.sq_entries; ++i)
+	    sq_array[i] = i;
+	cq_head_ = (unsigned*)(cq + p.cq_off.head);
+	cq_tail_ = (unsigned*)(cq + p.cq_off.tail);
+	cq_mask_ = *(unsigned*)(cq + p.cq_off.ring_mask);
+	cqes_ = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	// Provided buffer ring for multishot recv. io_uring_buf_ring is
+	// not used because its flexible array is misplaced in C++.
+	bring_ = (io_uring_buf*)mmap(NULL, nbuf * sizeof(io_uring_buf),
+					  PROT_READ | PROT_WRITE,
+					  MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	CHECK(bring_ != MAP_FAILED);
+	io_uring_buf_reg reg;
+	bzero(&reg, sizeof(reg));
+	reg.ring_addr = uintptr_t(bring_);
+	reg.ring_entries = nbuf;
+	reg.bgid = bgid;
+	CHECK(syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PBUF_RING, &reg, 1) == 0);
+	bufs_ = (uint8_t*)mmap(NULL, size_t(nbuf) * buf_size, PROT_READ | PROT_WRITE,
+			       MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	CHECK(bufs_ != MAP_FAILED);
+	for (int i = 0; i < nbuf; ++i)
+	    recycle(i);
+
+	CHECK((efd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0);
+	CHECK(syscall(__NR_io_uring_register, fd_, IORING_REGISTER_EVENTFD, &efd_, 1) == 0);
+	ev_.set(loop->ev_loop());
+	ev_.set<uring_loop, &uring_loop::eventfd_handler>(this);
+	ev_.start(efd_, ev::READ);
+	loop->add_edge_triggered(this);
+    }
+    void eventfd_handler(ev::io&, int) {
+	uint64_t x;
+	while (::read(efd_, &x, sizeof(x)) == -1 && errno == EINTR)
+	    ;
+	drain();
+    }
+    inline void reap();
+    inline void rearm_starved();
+
+    int fd_;
+    int efd_;
+    ev::io ev_;
+
+    io_uring_sqe* sqes_;
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned* sq_flags_;
+    unsigned sq_mask_;
+    unsigned sq_entries_;
+    unsigned sqe_tail_;  // next sqe to fill
+    unsigned submitted_; // sqes handed to the kernel
+
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned cq_mask_;
+    io_uring_cqe* cqes_;
+
+    io_uring_buf* bring_;
+    uint8_t* bufs_;
+    uint16_t btail_;
+
+    std::vector<uring_sock*> ready_;   // sockets with news for their uring_conn
+    std::vector<uring_sock*> starved_; // recv stopped for lack of buffers
+    std::vector<uring_target*> dead_;  // retired and idle, freed at the end of drain
+};
+
+// Kernel-facing state of a uring_conn. It outlives the uring_conn
+// until the kernel is done with it, and owns the file descriptor.
+struct uring_sock : public uring_target {
+    enum { op_recv, op_send, op_cancel };
+    enum { max_sendbuf = 1 << 18 };
+    // Provided buffers a socket may hold. Past that its recv is
+    // cancelled, and what the kernel has received meanwhile is copied to
+    // spill_, so that one unread connection can't keep the loop's
+    // buffers from the others.
+    enum { max_rq = 32 };
+
+    uring_sock(uring_loop* ul, int fd)
+	: ul_(ul), conn_(NULL), fd_(fd), error_(0), eof_(false), reading_(false),
+	  recv_armed_(false), recv_cancelled_(false), spill_off_(0), send_armed_(false),
+	  sent_(0), queued_(false) {
+    }
+    ~uring_sock() {
+	while (!rq_.empty()) {
+	    ul_->recycle(rq_.front().bid);
+	    rq_.pop_front();
+	}
+	::close(fd_);
+    }
+    void arm_recv() {
+	if (recv_armed_ || retired_ || error_ || eof_ || !reading_
+	    || rq_.size() >= max_rq || !spill_.empty())
+	    return;
+	io_uring_sqe* e = ul_->get_sqe();
+	e->opcode = IORING_OP_RECV;
+	e->fd = fd_;
+	e->ioprio = IORING_RECV_MULTISHOT;
+	e->flags = IOSQE_BUFFER_SELECT;
+	e->buf_group = uring_loop::bgid;
+	e->user_data = uring_loop::tag(this, op_recv);
+	recv_armed_ = true;
+    }
+    // ends the multishot recv; arm_recv starts it again
+    void cancel_recv() {
+	if (!recv_armed_ || recv_cancelled_)
+	    return;
+	io_uring_sqe* e = ul_->get_sqe();
+	e->opcode = IORING_OP_ASYNC_CANCEL;
+	e->addr = uintptr_t(this) | op_recv;
+	e->user_data = uring_loop::tag(this, op_cancel);
+	recv_cancelled_ = true;
+    }
+    void set_reading(bool on) {
+	reading_ = on;
+	if (on)
+	    arm_recv();
+	else
+	    cancel_recv();
+    }
+    void arm_send() {
+	assert(!send_armed_ && sent_ < sending_.length());
+	io_uring_sqe* e = ul_->get_sqe();
+	e->opcode = IORING_OP_SEND;
+	e->fd = fd_;
+	e->addr = uintptr_t(sending_.data() + sent_);
+	e->len = sending_.length() - sent_;
+	e->msg_flags = MSG_NOSIGNAL;
+	e->user_data = uring_loop::tag(this, op_send);
+	send_armed_ = true;
+    }
+    void retire() {
+	retired_ = true;
+	conn_ = NULL;
+	ul_->remove_queued(this);
+	io_uring_sqe* e = ul_->get_sqe();
+	e->opcode = IORING_OP_ASYNC_CANCEL;
+	e->fd = fd_;
+	e->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	e->user_data = uring_loop::tag(this, op_cancel);
+    }
+    inline void complete(int op, int res, uint32_t flags);
+
+    size_t sendbuf_room() const {
+	const std::string& b = send_armed_ ? pending_ : sending_;
+	return b.length() < max_sendbuf ? max_sendbuf - b.length() : 0;
+    }
+
+    struct rbuf {
+	uint16_t bid;
+	uint32_t off;
+	uint32_t len;
+    };
+
+    uring_loop* ul_;
+    uring_conn* conn_;
+    int fd_;
+    int error_;
+    bool eof_;
+    bool reading_;         // the uring_conn selects READ
+    bool recv_armed_;
+    bool recv_cancelled_;  // and being cancelled
+    bool send_armed_;
+    std::deque<rbuf> rq_;  // received data in provided buffers
+    std::string spill_;    // received after rq_ filled up
+    size_t spill_off_;
+    std::string sending_;  // in flight
+    size_t sent_;
+    std::string pending_;  // queued behind sending_
+    bool queued_;          // on uring_loop::ready_
+};
+
+// uring_conn
+struct uring_conn {
+    typedef std::function<bool(uring_conn*, int)> event_handler_type;
+
+    ~uring_conn() {
+	s_->retire();
+    }
+    ssize_t read(void* buffer, size_t len) {
+	size_t r = 0;
+	while (r < len && !s_->rq_.empty()) {
+	    uring_sock::rbuf& b = s_->rq_.front();
+	    size_t n = std::min(len - r, size_t(b.len - b.off));
+	    memcpy((char*)buffer + r, s_->ul_->buffer(b.bid) + b.off, n);
+	    r += n;
+	    b.off += n;
+	    if (b.off == b.len) {
+		s_->ul_->recycle(b.bid);
+		s_->rq_.pop_front();
+	    }
+	}
+	if (r < len && !s_->spill_.empty()) {
+	    size_t n = std::min(len - r, s_->spill_.length() - s_->spill_off_);
+	    memcpy((char*)buffer + r, s_->spill_.data() + s_->spill_off_, n);
+	    r += n;
+	    if ((s_->spill_off_ += n) == s_->spill_.length()) {
+		s_->spill_.clear();
+		s_->spill_off_ = 0;
+	    }
+	}
+	s_->arm_recv(); // if stopped for a full rq_
+	if (r)
+	    return r;
+	if (s_->error_) {
+	    errno = s_->error_;
+	    return -1;
+	} else if (s_->eof_)
+	    return 0;
+	errno = EAGAIN;
+	return -1;
+    }
+    ssize_t write(const void* buffer, size_t len) {
+	struct iovec iov;
+	iov.iov_base = const_cast<void*>(buffer);
+	iov.iov_len = len;
+	return writev(&iov, 1);
+    }
+    // Data is copied into the send buffer, so the caller may reuse
+    // its buffers as soon as writev returns.
+    ssize_t writev(const struct iovec* iov, int iovcnt) {
+	if (s_->error_) {
+	    errno = s_->error_;
+	    return -1;
+	}
+	size_t room = s_->sendbuf_room();
+	if (!room) {
+	    errno = EAGAIN;
+	    return -1;
+	}
+	std::string& b = s_->send_armed_ ? s_->pending_ : s_->sending_;
+	size_t w = 0;
+	for (int i = 0; i < iovcnt && w < room; ++i) {
+	    size_t n = std::min(iov[i].iov_len, room - w);
+	    b.append((const char*)iov[i].iov_base, n);
+	    w += n;
+	}
+	if (!s_->send_armed_)
+	    s_->arm_send();
+	return w;
+    }
+    void shutdown() {
+	::shutdown(s_->fd_, SHUT_RDWR);
+    }
+    void register_callback(event_handler_type cb, int flags) {
+	cb_ = cb;
+	assert(flags);
+	eselect(flags);
+    }
+    void eselect(int flags) {
+	ev_flags_ = flags;
+	s_->set_reading(flags & ev::READ);
+	if (ev_flags_ & ready_flags())
+	    s_->ul_->add_ready(s_);
+    }
+    int ev_flags() const {
+	return ev_flags_;
+    }
+    int ready_flags() const {
+	int flags = 0;
+	if (!s_->rq_.empty() || !s_->spill_.empty() || s_->eof_ || s_->error_)
+	    flags |= ev::READ;
+	if (s_->sendbuf_room() || s_->error_)
+	    flags |= ev::WRITE;
+	return flags;
+    }
+    // returns true if the connection is deleted by the callback
+    bool dispatch() {
+	bool deleted = false;
+	while (!deleted) {
+	    int interest = ready_flags() & ev_flags_;
+	    if (!interest)
+		break;
+	    deleted = cb_(this, interest);
+	}
+	return deleted;
+    }
+
+  protected:
+    friend class uringnet;
+    uring_conn(int fd) : ev_flags_(0) {
+	rpc::common::sock_helper::make_nodelay(fd);
+	s_ = new uring_sock(uring_loop::get_tls_loop(), fd);
+	s_->conn_ = this;
+    }
+
+  private:
+    uring_sock* s_;
+    event_handler_type cb_;
+    int ev_flags_;
+};
+
+/** @brief Multishot accept on a listening socket. Call stop() instead
+    of deleting it; the loop frees it once the kernel lets go. */
+struct uring_acceptor : public uring_target {
+    typedef std::function<void(int)> accept_handler_type;
+
+    static uring_acceptor* start(int listener, accept_handler_type cb) {
+	return new uring_acceptor(listener, cb);
+    }
+    ~uring_acceptor() {
+	retry_.stop();
+    }
+    void stop() {
+	retired_ = true;
+	retry_.stop();
+	io_uring_sqe* e = ul_->get_sqe();
+	e->opcode = IORING_OP_ASYNC_CANCEL;
+	e->fd = listener_;
+	e->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	e->user_data = uring_loop::tag(this, op_cancel);
+    }
+    void complete(int op, int res, uint32_t flags) {
+	if (op != op_accept || retired_) {
+	    if (res >= 0 && op == op_accept)
+		::close(res);
+	    return;
+	}
+	bool wait = false;
+	if (res >= 0)
+	    cb_(res);
+	else if (res != -ECANCELED) {
+	    fprintf(stderr, "uring_acceptor: %s\n", strerror(-res));
+	    // e.g. out of fds: accepting again at once would fail at once
+	    wait = res != -ECONNABORTED && res != -EPROTO;
+	}
+	if (!(flags & IORING_CQE_F_MORE)) {
+	    if (wait)
+		retry_.start(0.1);
+	    else
+		arm();
+	}
+    }
+  private:
+    enum { op_accept, op_cancel };
+    uring_acceptor(int listener, accept_handler_type cb)
+	: ul_(uring_loop::get_tls_loop()), listener_(listener), cb_(cb),
+	  retry_(nn_loop::get_tls_loop()->ev_loop()) {
+	retry_.set<uring_acceptor, &uring_acceptor::retry>(this);
+	arm();
+    }
+    void arm() {
+	io_uring_sqe* e = ul_->get_sqe();
+	e->opcode = IORING_OP_ACCEPT;
+	e->fd = listener_;
+	e->ioprio = IORING_ACCEPT_MULTISHOT;
+	e->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	e->user_data = uring_loop::tag(this, op_accept);
+    }
+
+    void retry(ev::timer&, int) {
+	arm();
+    }
+
+    uring_loop* ul_;
+    int listener_;
+    accept_handler_type cb_;
+    ev::timer retry_;  // arming again after an error
+};
+
+inline void uring_sock::complete(int op, int res, uint32_t flags) {
+    if (op == op_recv) {
+	if (res > 0) {
+	    assert(flags & IORING_CQE_F_BUFFER);
+	    uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+	    if (rq_.size() < max_rq && spill_.empty()) {
+		rbuf b;
+		b.bid = bid;
+		b.off = 0;
+		b.len = res;
+		rq_.push_back(b);
+	    } else {
+		spill_.append((const char*)ul_->buffer(bid), res);
+		ul_->recycle(bid);
+	    }
+	    if (rq_.size() >= max_rq)
+		cancel_recv();
+	} else if (res == 0)
+	    eof_ = true;
+	else if (res != -ENOBUFS && res != -ECANCELED && !error_)
+	    error_ = -res;
+	if (!(flags & IORING_CQE_F_MORE)) {
+	    recv_armed_ = recv_cancelled_ = false;
+	    if (res == -ENOBUFS && !retired_)
+		ul_->add_starved(this); // rearm once buffers come back
+	    else
+		arm_recv();
+	}
+    } else if (op == op_send) {
+	send_armed_ = false;
+	if (res < 0) {
+	    if (res != -ECANCELED && !error_)
+		error_ = -res;
+	} else if ((sent_ += res) < sending_.length()) {
+	    if (!retired_)
+		arm_send();
+	} else {
+	    sending_.clear();
+	    sent_ = 0;
+	    sending_.swap(pending_);
+	    if (sending_.length() && !retired_)
+		arm_send();
+	}
+    }
+    if (conn_)
+	ul_->add_ready(this);
+}
+
+inline void uring_loop::add_starved(uring_sock* s) {
+    starved_.push_back(s);
+}
+
+inline void uring_loop::rearm_starved() {
+    std::vector<uring_sock*> starved;
+    starved.swap(starved_);
+    for (auto s : starved)
+	s->arm_recv();
+}
+
+inline void uring_loop::add_ready(uring_sock* s) {
+    if (!s->queued_) {
+	s->queued_ = true;
+	ready_.push_back(s);
+    }
+}
+
+inline void uring_loop::remove_queued(uring_sock* s) {
+    if (s->queued_) {
+	ready_.erase(std::find(ready_.begin(), ready_.end(), s));
+	s->queued_ = false;
+    }
+    auto it = std::find(starved_.begin(), starved_.end(), s);
+    if (it != starved_.end())
+	starved_.erase(it);
+}
+
+inline void uring_loop::reap() {
+    unsigned head = *cq_head_;
+    while (1) {
+	if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+	    if (!(__atomic_load_n(sq_flags_, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW))
+		break;
+	    // let the kernel flush overflowed completions into the ring
+	    syscall(__NR_io_uring_enter, fd_, 0, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+	    continue;
+	}
+	io_uring_cqe cqe = cqes_[head & cq_mask_];
+	__atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+	uring_target* t = (uring_target*)(uintptr_t(cqe.user_data) & ~uintptr_t(3));
+	if (!(cqe.flags & IORING_CQE_F_MORE))
+	    --t->inflight_;
+	t->complete(cqe.user_data & 3, cqe.res, cqe.flags);
+	if (t->retired_ && !t->inflight_)
+	    dead_.push_back(t);
+    }
+}
+
+inline bool uring_loop::drain() {
+    submit();
+    reap();
+    bool dispatched = false;
+    std::vector<uring_sock*> ready;
+    ready.swap(ready_);
+    for (auto s : ready)
+	s->queued_ = false;
+    // A callback may delete any connection on the list. Its socket
+    // is then retired, and is not freed before the end of drain.
+    for (auto s : ready)
+	if (uring_conn* c = s->conn_)
+	    if (c->ready_flags() & c->ev_flags()) {
+		dispatched = true;
+		c->dispatch();
+	    }
+    submit();
+    for (auto t : dead_)
+	delete t;
+    dead_.clear();
+    return dispatched || !ready_.empty();
+}
+
+struct uringnet {
+    template <typename T>
+    using select_provider = epoll_tcpfds<T>;
+
+    typedef socket_wrapper sync_transport;
+    typedef uring_conn async_transport;
+    template <typename T>
+    static T* make(int fd) {
+	T* c = new T(fd);
+	if (!c)
+	    close(fd);
+	return c;
+    }
+    static sync_transport* make_sync(int fd) {
+	return make<sync_transport>(fd);
+    }
+    static async_transport* make_async(int fd) {
+	return make<async_transport>(fd);
+    }
+    static void set_poll_interval(int) {
+    }
+};
+
+}
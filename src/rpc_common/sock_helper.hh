@@ -3,6 +3,7 @@
 #include "rpc_common/compiler.hh"
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -10,46 +11,157 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 #include <string>
+#include <vector>
 
 namespace rpc {
 
 namespace common {
 
+// an address of any family, as resolved by sock_helper::resolve
+struct endpoint {
+    endpoint() : len(0) {
+        bzero(&ss, sizeof(ss));
+    }
+    int family() const {
+        return ss.ss_family;
+    }
+    const struct sockaddr* sa() const {
+        return (const struct sockaddr*) &ss;
+    }
+    void set_port(int port) {
+        if (family() == AF_INET6)
+            ((struct sockaddr_in6*) &ss)->sin6_port = htons(port);
+        else
+            ((struct sockaddr_in*) &ss)->sin_port = htons(port);
+    }
+    struct sockaddr_storage ss;
+    socklen_t len;
+};
+
 class sock_helper {
   public:
+    // Blocking; -1 if @a host does not resolve or refuses.
     static int connect(const char *host, int port, const char* localhost = "0.0.0.0", int localport = 0) {
-        int fd = socket(AF_INET, SOCK_STREAM, 0);
-        assert(fd >= 0);
-	struct sockaddr_in localaddr;
-        make_sockaddr(localhost, localport, localaddr);
-	int r = ::bind(fd, (struct sockaddr *) &localaddr, sizeof(localaddr));
-	mandatory_assert(!r);
-
-        struct sockaddr_in sin;
-        make_sockaddr(host, port, sin);
-        if (::connect(fd, (sockaddr *)&sin, sizeof(sin)) != 0) {
+        std::vector<endpoint> a;
+        if (!resolve(host, port, a))
+            return -1;
+        return connect(a[0], localhost, localport);
+    }
+    static int connect(const endpoint& remote, const char* localhost = "0.0.0.0", int localport = 0) {
+        int fd = bound_socket(remote.family(), localhost, localport);
+        if (fd < 0)
+            return -1;
+        if (::connect(fd, remote.sa(), remote.len) != 0) {
             close(fd);
             return -1;
         }
         return fd;
     }
-    static int listen(const std::string& h, int port, int backlog = 0) {
-	int fd = socket(AF_INET, SOCK_STREAM, 0);
+    // Starts connecting without waiting for the handshake. @a in_progress
+    // is set if the caller must wait for the socket to become writable
+    // (or to fail) before the connection is established.
+    static int connect_nonblock(const char *host, int port, const char* localhost,
+				int localport, bool& in_progress) {
+        std::vector<endpoint> a;
+        if (!resolve(host, port, a))
+            return -1;
+        return connect_nonblock(a[0], localhost, localport, in_progress);
+    }
+    static int connect_nonblock(const endpoint& remote, const char* localhost,
+				int localport, bool& in_progress) {
+        int fd = bound_socket(remote.family(), localhost, localport);
+        if (fd < 0)
+            return -1;
+	make_nonblock(fd);
+	in_progress = false;
+#ifdef TCP_FASTOPEN_CONNECT
+	// connect() returns at once and the first write goes out in the SYN
+	int yes = 1;
+	if (fastopen() && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &yes, sizeof(yes)) == 0)
+	    in_progress = true;
+#endif
+        if (::connect(fd, remote.sa(), remote.len) != 0) {
+	    if (errno == EINPROGRESS)
+		in_progress = true;
+	    else {
+		close(fd);
+		return -1;
+	    }
+        }
+        return fd;
+    }
+    // All addresses of @a host (a name, or an IPv4 or IPv6 literal) for
+    // @a port, in the order getaddrinfo returns them. Blocking.
+    static bool resolve(const char *host, int port, std::vector<endpoint>& out,
+                        int family = AF_UNSPEC, bool passive = false) {
+        struct addrinfo hints, *res;
+        bzero(&hints, sizeof(hints));
+        hints.ai_family = family;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICSERV | (passive ? AI_PASSIVE : 0);
+        char service[16];
+        snprintf(service, sizeof(service), "%d", port);
+        int r = getaddrinfo(host, service, &hints, &res);
+        if (r != 0) {
+            fprintf(stderr, "Cannot resolve %s: %s\n", host, gai_strerror(r));
+            return false;
+        }
+        out.clear();
+        for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+            endpoint e;
+            memcpy(&e.ss, ai->ai_addr, ai->ai_addrlen);
+            e.len = ai->ai_addrlen;
+            out.push_back(e);
+        }
+        freeaddrinfo(res);
+        return !out.empty();
+    }
+    // Whether sockets created from now on use TCP Fast Open: listeners
+    // accept data in the SYN, and connect_nonblock sends the first write
+    // with it. The kernel must allow it (net.ipv4.tcp_fastopen). Pass a
+    // negative value to query.
+    static bool fastopen(int enable = -1) {
+	static bool on = false;
+	if (enable >= 0)
+	    on = enable;
+	return on;
+    }
+    // With @a reuseport, several sockets (e.g. one per thread) may listen
+    // on the same port, and the kernel spreads new connections over them.
+    static int listen(const std::string& h, int port, int backlog = 0, bool reuseport = false) {
+        std::vector<endpoint> a;
+        if (!resolve(h.c_str(), port, a, AF_UNSPEC, true)) {
+	    fprintf(stderr, "Can't bind to %s:%d\n", h.c_str(), port);
+	    mandatory_assert(0 && "Bind failure");
+        }
+	int fd = socket(a[0].family(), SOCK_STREAM, 0);
 	assert(fd >= 0);
 	int yes = 1;
 	int r = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
 	mandatory_assert(r == 0);
-	struct sockaddr_in sin;
-        make_sockaddr(h.c_str(), port, sin);
-	r = ::bind(fd, (struct sockaddr *) &sin, sizeof(sin));
+	if (reuseport) {
+#ifdef SO_REUSEPORT
+	    r = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+	    mandatory_assert(r == 0);
+#else
+	    mandatory_assert(0 && "SO_REUSEPORT is not supported");
+#endif
+	}
+	r = ::bind(fd, a[0].sa(), a[0].len);
 	if (r != 0) {
 	    fprintf(stderr, "Can't bind to %s:%d\n", h.c_str(), port);
 	    mandatory_assert(0 && "Bind failure");
 	}
+#ifdef TCP_FASTOPEN
+	int qlen = backlog ? backlog : 100;
+	if (fastopen())
+	    setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen));
+#endif
 	r = ::listen(fd, backlog ? backlog : 100);
 	mandatory_assert(r == 0);
 	return fd;
@@ -57,6 +169,69 @@ class sock_helper {
     static int listen(int port, int backlog = 0) {
         return listen("0.0.0.0", port, backlog);
     }
+    static int connect_unix(const char *path) {
+        struct sockaddr_un sun;
+        if (!make_sockaddr(path, sun))
+            return -1;
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        assert(fd >= 0);
+        if (::connect(fd, (sockaddr *)&sun, sizeof(sun)) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    // replaces any stale socket file at path
+    static int listen_unix(const std::string& path, int backlog = 0) {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	assert(fd >= 0);
+	struct sockaddr_un sun;
+	int r = -1;
+	if (make_sockaddr(path.c_str(), sun)) {
+	    unlink(path.c_str());
+	    r = ::bind(fd, (struct sockaddr *) &sun, sizeof(sun));
+	}
+	if (r != 0) {
+	    fprintf(stderr, "Can't bind to %s\n", path.c_str());
+	    mandatory_assert(0 && "Bind failure");
+	}
+	r = ::listen(fd, backlog ? backlog : 100);
+	mandatory_assert(r == 0);
+	return fd;
+    }
+    // a UDP socket whose datagrams all go to host:port
+    static int connect_udp(const char *host, int port) {
+        struct sockaddr_in sin;
+        if (!make_sockaddr(host, port, sin))
+            return -1;
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        assert(fd >= 0);
+        if (::connect(fd, (sockaddr *)&sin, sizeof(sin)) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    // several threads may bind the same port; the kernel spreads
+    // the peers over their sockets
+    static int bind_udp(const std::string& h, int port) {
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	assert(fd >= 0);
+	int yes = 1;
+	int r = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	mandatory_assert(r == 0);
+#ifdef SO_REUSEPORT
+	r = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+	mandatory_assert(r == 0);
+#endif
+	struct sockaddr_in sin;
+	r = make_sockaddr(h.c_str(), port, sin) ? ::bind(fd, (struct sockaddr *) &sin, sizeof(sin)) : -1;
+	if (r != 0) {
+	    fprintf(stderr, "Can't bind to %s:%d\n", h.c_str(), port);
+	    mandatory_assert(0 && "Bind failure");
+	}
+	return fd;
+    }
     static int accept(int fd) {
 	struct sockaddr_in sin;
 	socklen_t sinlen;
@@ -69,47 +244,97 @@ class sock_helper {
 	    perror("accept");
 	return rfd;
     }
+    // Non-blocking and close-on-exec from the start. -1 with errno set
+    // if there is nothing to accept or on error.
+    static int accept_nonblock(int fd) {
+#ifdef SOCK_NONBLOCK
+	return ::accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	int rfd = ::accept(fd, NULL, NULL);
+	if (rfd >= 0) {
+	    make_nonblock(rfd);
+	    fcntl(rfd, F_SETFD, FD_CLOEXEC);
+	}
+	return rfd;
+#endif
+    }
     static void make_nodelay(int fd) {
         int yes = 1;
         mandatory_assert(fd >= 0);
 	int r = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
-	mandatory_assert(r == 0);
+	// not a TCP socket (AF_UNIX): nothing to do
+	mandatory_assert(r == 0 || errno == EOPNOTSUPP);
     }
     static void make_nonblock(int fd) {
-	int r = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	int fl = fcntl(fd, F_GETFL, 0);
+	// e.g. from accept_nonblock
+	if (fl & O_NONBLOCK)
+	    return;
+	int r = fcntl(fd, F_SETFL, fl | O_NONBLOCK);
 	mandatory_assert(r == 0);
     }
+    // false while a non-blocking connect is still in progress
+    static bool established(int fd) {
+        struct sockaddr_storage ss;
+        socklen_t len = sizeof(ss);
+        return getpeername(fd, (sockaddr*)&ss, &len) == 0;
+    }
     static uint64_t get_uid(const char *host, int port) {
         sockaddr_in sin;
-        make_sockaddr(host, port, sin);
+        if (!make_sockaddr(host, port, sin))
+            return 0;
         return((uint64_t)(sin.sin_addr.s_addr) << 32) | port;
     }
     static void peerinfo(int s, std::string& addr, int& port) {
-        sockaddr_in sin;
-        socklen_t len = sizeof(sin);
-        int r = getpeername(s, (sockaddr*)&sin, &len);
+        struct sockaddr_storage ss;
+        socklen_t len = sizeof(ss);
+        int r = getpeername(s, (sockaddr*)&ss, &len);
         mandatory_assert(r == 0);
-        port = ntohs(sin.sin_port);
-        char buf[128];
-        mandatory_assert(inet_ntop(sin.sin_family, &sin.sin_addr, buf, sizeof(buf)));
+        char buf[INET6_ADDRSTRLEN];
+        if (ss.ss_family == AF_INET6) {
+            struct sockaddr_in6* sin6 = (struct sockaddr_in6*) &ss;
+            port = ntohs(sin6->sin6_port);
+            mandatory_assert(inet_ntop(AF_INET6, &sin6->sin6_addr, buf, sizeof(buf)));
+        } else {
+            struct sockaddr_in* sin = (struct sockaddr_in*) &ss;
+            port = ntohs(sin->sin_port);
+            mandatory_assert(inet_ntop(AF_INET, &sin->sin_addr, buf, sizeof(buf)));
+        }
         addr.assign(buf, strlen(buf));
     }
   private:
-    static void make_sockaddr(const char *host, int port, struct sockaddr_in &sin) {
-        bzero(&sin, sizeof(sin));
-        sin.sin_family = AF_INET;
-        in_addr_t a = inet_addr(host);
-        if (a != INADDR_NONE)
-            sin.sin_addr.s_addr = a;
-        else {
-            struct hostent *hp = gethostbyname(host);
-            if (hp == NULL || hp->h_length != 4 || hp->h_addrtype != AF_INET) {
-                fprintf(stderr, "Cannot get an IPV4 address for host %s\n", host);
-                exit(-1);
-            }
-            sin.sin_addr.s_addr = ((struct in_addr *)(hp->h_addr))->s_addr;
+    static bool make_sockaddr(const char *path, struct sockaddr_un &sun) {
+        bzero(&sun, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(sun.sun_path)) {
+            fprintf(stderr, "Socket path too long: %s\n", path);
+            return false;
+        }
+        strcpy(sun.sun_path, path);
+        return true;
+    }
+    // IPv4 only, for UDP
+    static bool make_sockaddr(const char *host, int port, struct sockaddr_in &sin) {
+        std::vector<endpoint> a;
+        if (!resolve(host, port, a, AF_INET))
+            return false;
+        memcpy(&sin, &a[0].ss, sizeof(sin));
+        return true;
+    }
+    // a socket of @a family bound to @a localhost:@a localport
+    static int bound_socket(int family, const char* localhost, int localport) {
+        int fd = socket(family, SOCK_STREAM, 0);
+        assert(fd >= 0);
+        // the default wildcard only means "any address"
+        if (localport == 0 && (!strcmp(localhost, "0.0.0.0") || !strcmp(localhost, "::")))
+            return fd;
+        std::vector<endpoint> a;
+        if (!resolve(localhost, localport, a, family, true)
+            || ::bind(fd, a[0].sa(), a[0].len) != 0) {
+            close(fd);
+            return -1;
         }
-        sin.sin_port = htons(port);
+        return fd;
     }
 };
 
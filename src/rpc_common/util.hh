@@ -6,6 +6,7 @@
 #include <sys/resource.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <memory>
 #include "rpc_common/compiler.hh"
 
@@ -37,6 +38,13 @@ inline uint64_t tstamp() {
     return rpc::common::tv2us(tv);
 }
 
+// CPU time of the calling thread, in microseconds
+inline uint64_t thread_cputime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 inline double to_real(timeval tv) {
     return tv.tv_sec + tv.tv_usec / (double) 1e6;
 }